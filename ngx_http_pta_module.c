@@ -15,8 +15,223 @@
 #include <ngx_http_request.h>
 
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
 
 #include <syslog.h>
+#include <time.h>
+
+typedef struct
+{
+    ngx_str_t id;
+    ngx_str_t glob;
+#if (NGX_PCRE)
+    ngx_regex_t *regex;
+    ngx_int_t captures;
+#endif
+    ngx_flag_t param;
+} ngx_http_pta_policy_t;
+
+// A revocation file is "PTAR", a version and the number of fingerprints,
+// each 32-bit big endian, followed by the sorted 8-byte fingerprints. The
+// fingerprint of a token is its last 8 bytes of cipher text.
+typedef struct
+{
+    ngx_str_t name;
+    ngx_uint_t missing;
+    time_t mtime;
+    off_t size;
+    ngx_file_uniq_t uniq;
+    u_char *map;
+    size_t map_size;
+    u_char *list;
+    ngx_uint_t nelts;
+    uint64_t *bloom;
+    uint32_t bloom_mask;
+} ngx_http_pta_revocation_t;
+
+#define NGX_HTTP_PTA_REVOCATION_MAGIC    "PTAR"
+#define NGX_HTTP_PTA_REVOCATION_VERSION  1
+#define NGX_HTTP_PTA_REVOCATION_HEADER   12
+#define NGX_HTTP_PTA_FINGERPRINT_LEN     8
+
+// A renewed token has two NULs, the fingerprint of the token it was first
+// renewed from and its expiration time, 64-bit big endian, after the path.
+#define NGX_HTTP_PTA_ORIGIN_LEN  (2 + NGX_HTTP_PTA_FINGERPRINT_LEN + 8)
+
+// Revoked prefixes are a trie with a level per nibble of the path. Nodes
+// are only added, under the zone mutex, and published after they are
+// filled in, so workers walk it without locking.
+typedef struct ngx_http_pta_prefix_s ngx_http_pta_prefix_t;
+
+struct ngx_http_pta_prefix_s
+{
+    ngx_http_pta_prefix_t *child[16];
+    ngx_atomic_t revoked;
+};
+
+// Revoked fingerprints are an open addressing hash set, also changed
+// under the zone mutex only. Removed entries are marked deleted, and once
+// they fill the table, the live ones are copied to the spare table, which
+// then takes the place of the current one. The generation is bumped before
+// the spare table is cleared, and a worker that saw it change while
+// probing looks again, as it may have been on that table.
+typedef struct
+{
+    uint64_t *slots;
+    uint64_t *spare;
+    ngx_uint_t mask;
+    ngx_uint_t limit;           /* of slots used, deleted ones included */
+    ngx_uint_t used;
+    ngx_atomic_t nelts;
+    ngx_atomic_t generation;
+} ngx_http_pta_fpset_t;
+
+#define NGX_HTTP_PTA_FP_EMPTY    0
+#define NGX_HTTP_PTA_FP_DELETED  1
+
+#define ngx_http_pta_fp_slot(v, mask)                                       \
+    ((ngx_uint_t) (((v) * 0x9e3779b97f4a7c15ULL) >> 32) & (mask))
+
+// Failures of all workers are counted per second. The worker that first
+// sees the next second takes the count and is the only one to turn the
+// overload mode on or off for that second.
+typedef struct
+{
+    ngx_atomic_t sec;
+    ngx_atomic_t failures;
+    ngx_atomic_t active;
+    ngx_atomic_t calm_since;
+    ngx_atomic_t entered;
+} ngx_http_pta_overload_t;
+
+typedef struct
+{
+    ngx_http_pta_prefix_t prefixes;
+    ngx_atomic_t nprefixes;
+    size_t prefixes_size;       /* of the list pta_admin returns */
+    ngx_http_pta_fpset_t fingerprints;
+    ngx_atomic_t *inflight;
+    ngx_uint_t inflight_mask;
+    ngx_atomic_t *rates;
+    ngx_atomic_t *failures;
+    ngx_http_pta_overload_t overload;
+} ngx_http_pta_shctx_t;
+
+typedef struct
+{
+    ngx_http_pta_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_uint_t fingerprints;
+    ngx_uint_t counters;
+} ngx_http_pta_zone_ctx_t;
+
+#define NGX_HTTP_PTA_ZONE_FINGERPRINTS  10000
+#define NGX_HTTP_PTA_ZONE_COUNTERS      65536
+
+// in-flight requests are counted in two counters picked by the
+// fingerprint, and the smaller count is taken, so that tokens sharing one
+// counter by chance rarely limit each other
+#define ngx_http_pta_fp_slot2(v, mask)                                      \
+    ((ngx_uint_t) (((v) * 0xc2b2ae3d27d4eb4fULL) >> 32) & (mask))
+
+typedef struct
+{
+    ngx_atomic_t *count[2];
+} ngx_http_pta_inflight_t;
+
+// A leaky bucket of pta_rate is the time of the last request in msec in
+// the upper 32 bits and the excess in the lower ones, updated as a whole
+// with compare and swap. Buckets are picked like in-flight counters.
+#define NGX_HTTP_PTA_RATE_MAX_BURST  1000000
+
+// Failures of a client network are counted in a word of the time the
+// window or the penalty started in the upper 32 bits, a penalty flag and
+// the count, in two slots picked by a hash of the network.
+#define NGX_HTTP_PTA_FAIL_BOXED  0x80000000
+#define NGX_HTTP_PTA_FAIL_COUNT  0x7fffffff
+
+// keeps ngx_msec_t from overflowing where it's 32 bits
+#define NGX_HTTP_PTA_DEADLINE_TIMER_MAX  86400
+
+#define NGX_HTTP_PTA_PREFIX_MAX  512
+
+// counters of a location for pta_status, in the order of
+// ngx_http_pta_metrics
+#define NGX_HTTP_PTA_STAT_OUTCOME    0   /* pass, 400, 403, 410, other */
+#define NGX_HTTP_PTA_STAT_REASON     5   /* #1 .. #9, decrypt, revoked, ... */
+#define NGX_HTTP_PTA_STAT_KEY        19
+#define NGX_HTTP_PTA_STAT_METHOD     21
+#define NGX_HTTP_PTA_STAT_FALLBACK   26
+#define NGX_HTTP_PTA_STAT_CANDIDATE  27
+#define NGX_HTTP_PTA_STAT_N          28
+
+// failure reasons after the "pta token is invalid #N" ones
+#define NGX_HTTP_PTA_REASON_DECRYPT  10
+#define NGX_HTTP_PTA_REASON_REVOKED  11
+#define NGX_HTTP_PTA_REASON_EXPIRED  12
+#define NGX_HTTP_PTA_REASON_URL      13
+#define NGX_HTTP_PTA_REASON_PENALTY  14
+
+typedef struct
+{
+    uint32_t layout;
+    size_t capacity;
+} ngx_http_pta_stat_sh_t;
+
+// Each worker adds to its own row of counters, a row being the counters
+// of all locations, and pta_status sums up the rows.
+typedef struct
+{
+    ngx_http_pta_stat_sh_t *sh;
+    ngx_atomic_t *counters;
+    uint32_t layout;            /* of the location names and rows */
+    ngx_uint_t rows;
+    ngx_uint_t row_size;
+    ngx_uint_t timing;          /* offset of the histograms in a row */
+    size_t size;
+} ngx_http_pta_stat_ctx_t;
+
+// the slab pool and its page descriptors
+#define NGX_HTTP_PTA_STAT_SLACK  (16 * ngx_pagesize)
+
+// stages of verification timed by pta_timing_sample
+#define NGX_HTTP_PTA_TIMING_BUILD   0
+#define NGX_HTTP_PTA_TIMING_HEX     1
+#define NGX_HTTP_PTA_TIMING_DECRYPT 2
+#define NGX_HTTP_PTA_TIMING_CRC     3
+#define NGX_HTTP_PTA_TIMING_MATCH   4
+#define NGX_HTTP_PTA_TIMING_DELETE  5
+#define NGX_HTTP_PTA_TIMING_N       6
+
+// A log-linear histogram in nsec, of a bucket below 2^MIN and four
+// buckets for each power of two up to 2^MAX, followed by a bucket above
+// it, the count and the sum.
+#define NGX_HTTP_PTA_TIMING_MIN      6
+#define NGX_HTTP_PTA_TIMING_MAX      24
+#define NGX_HTTP_PTA_TIMING_BUCKETS                                         \
+    (1 + (NGX_HTTP_PTA_TIMING_MAX - NGX_HTTP_PTA_TIMING_MIN) * 4)
+#define NGX_HTTP_PTA_TIMING_COUNT    (NGX_HTTP_PTA_TIMING_BUCKETS + 1)
+#define NGX_HTTP_PTA_TIMING_SUM      (NGX_HTTP_PTA_TIMING_BUCKETS + 2)
+#define NGX_HTTP_PTA_TIMING_SIZE     (NGX_HTTP_PTA_TIMING_BUCKETS + 3)
+
+#define NGX_HTTP_PTA_TIMING_HELP                                            \
+    "Time taken by the stages of sampled verifications."
+
+typedef struct
+{
+    ngx_shm_zone_t *shm_zone;
+    ngx_uint_t overload_on;
+    ngx_uint_t overload_off;
+    time_t overload_hold;
+    size_t overload_max_token;
+    ngx_uint_t overload_max_candidates;
+    ngx_shm_zone_t *stat_zone;
+    ngx_array_t stat_locations;
+    ngx_flag_t status;
+    ngx_int_t timing_sample;
+    ngx_array_t revocations;    /* of ngx_http_pta_revocation_t * */
+} ngx_http_pta_main_conf_t;
 
 typedef struct
 {
@@ -24,12 +239,48 @@ typedef struct
     ngx_str_t iv_1st;
     ngx_str_t key_2nd;
     ngx_str_t iv_2nd;
+    ngx_str_t ticket_key;
+    ngx_str_t assertion_key;
+    uint8_t key_bin[2][16];
+    uint8_t iv_bin[2][16];
+    ngx_array_t *policies;
+    ngx_http_pta_revocation_t *revocation;
+    ngx_radix_tree_t *trusted;
+#if (NGX_HAVE_INET6)
+    ngx_radix_tree_t *trusted6;
+#endif
 } ngx_http_pta_srv_conf_t;
 
 typedef struct
 {
     ngx_flag_t pta_onoff;
     ngx_uint_t pta_auth_method;
+    ngx_str_t auth_header;
+    ngx_int_t auth_header_index;
+    ngx_str_t auth_path;
+    ngx_flag_t cache_control;
+    time_t cache_control_max;
+    ngx_flag_t session_ticket;
+    time_t session_ticket_ttl;
+    time_t renew_within;
+    time_t renew_lifetime;
+    time_t renew_max;
+    ngx_str_t renew_header;
+    ngx_uint_t cookie_max_candidates;
+    size_t cookie_max_scan;
+    ngx_uint_t max_concurrent;
+    ngx_uint_t rate;
+    ngx_uint_t burst;
+    ngx_uint_t fail_threshold;
+    time_t fail_window;
+    time_t fail_penalty;
+    ngx_uint_t fail_ipv4_prefix;
+    ngx_uint_t fail_ipv6_prefix;
+    ngx_flag_t assertion;
+    time_t assertion_ttl;
+    ngx_flag_t accept_assertion;
+    ngx_flag_t enforce_deadline;
+    ngx_uint_t stat_index;
 } ngx_http_pta_loc_conf_t;
 
 typedef struct
@@ -37,26 +288,76 @@ typedef struct
     uint32_t crc;
     time_t deadline;
     u_char *url;
+    size_t url_len;
     uint8_t padding_val;
+    u_char *origin;
+    time_t origin_deadline;
 } ngx_http_pta_data_t;
 
+#define NGX_HTTP_PTA_COOKIE_MAX  16
+
 typedef struct
 {
     ngx_str_t encrypt_string;
     uint8_t *encrypt_data;
     size_t encrypt_data_len;
     ngx_http_pta_data_t decrypt_data;
-    ngx_array_t *encrypt_data_array;
+    ngx_str_t encrypt_data_array[NGX_HTTP_PTA_COOKIE_MAX];
+    uint8_t encrypt_data_key[NGX_HTTP_PTA_COOKIE_MAX];
+    uint16_t encrypt_data_array_nelts;
     uint16_t encrypt_data_array_idx;
-    uint8_t need_fallback_cookie;
+    uint8_t cookie_parsed;
+    u_char *qs_first;
+    uint16_t qs_count;
+    uint8_t qs_parsed;
+    uint8_t auth_fallback;
     uint8_t auth_type;
+    uint8_t key_first;
+    uint8_t strict;
+    uint8_t reason;
+    uint8_t timed;
+    uint64_t timing[NGX_HTTP_PTA_TIMING_N];
 } ngx_http_pta_info_t;
 
+typedef struct
+{
+    time_t deadline;
+    u_char *body_token;
+    size_t body_token_len;
+    ngx_int_t status;
+    ngx_event_t deadline_ev;
+    uint64_t timing[NGX_HTTP_PTA_TIMING_N];
+    unsigned verified:1;
+    unsigned timed:1;
+    unsigned body_reading:1;
+    unsigned body_waiting:1;
+    unsigned body_done:1;
+    unsigned body_state:2;
+    unsigned body_match:3;
+} ngx_http_pta_ctx_t;
+
+#define NGX_HTTP_PTA_BODY_NAME   0
+#define NGX_HTTP_PTA_BODY_SKIP   1
+#define NGX_HTTP_PTA_BODY_VALUE  2
+#define NGX_HTTP_PTA_BODY_FOUND  3
+
+/* hex of the largest token check_crc accepts */
+#define NGX_HTTP_PTA_BODY_TOKEN_MAX  (2 * (4 + 8 + 8192 + 16))
+
 #define QUERY_PARAM  "pta"
+#define TICKET_COOKIE  "pta_st"
+#define ASSERTION_HEADER  "X-PTA-Assertion"
+
+#define NGX_HTTP_PTA_MAC_LEN      16
+#define NGX_HTTP_PTA_MAC_STR_LEN  22    /* base64url without padding */
 
 static ngx_int_t ngx_http_pta_check_crc (ngx_http_pta_info_t *);
 static ngx_int_t ngx_http_pta_init (ngx_conf_t *);
 static ngx_int_t ngx_http_pta_handler (ngx_http_request_t *);
+static ngx_int_t ngx_http_pta_request_body_filter (ngx_http_request_t *,
+                                                   ngx_chain_t *);
+static void *ngx_http_pta_create_main_conf (ngx_conf_t *);
+static char *ngx_http_pta_init_main_conf (ngx_conf_t *, void *);
 static void *ngx_http_pta_create_srv_conf (ngx_conf_t *);
 static void *ngx_http_pta_create_loc_conf (ngx_conf_t *);
 static char *ngx_http_pta_merge_loc_conf (ngx_conf_t *, void *, void *);
@@ -64,19 +365,146 @@ static char *ngx_http_pta_set_1st_key (ngx_conf_t *, ngx_command_t *, void *);
 static char *ngx_http_pta_set_1st_iv (ngx_conf_t *, ngx_command_t *, void *);
 static char *ngx_http_pta_set_2nd_key (ngx_conf_t *, ngx_command_t *, void *);
 static char *ngx_http_pta_set_2nd_iv (ngx_conf_t *, ngx_command_t *, void *);
+static char *ngx_http_pta_set_auth_method (ngx_conf_t *, ngx_command_t *,
+                                           void *);
+static char *ngx_http_pta_set_cache_control (ngx_conf_t *, ngx_command_t *,
+                                             void *);
+static char *ngx_http_pta_set_policy (ngx_conf_t *, ngx_command_t *, void *);
+static char *ngx_http_pta_set_revocation_file (ngx_conf_t *, ngx_command_t *,
+                                               void *);
+static char *ngx_http_pta_set_trusted (ngx_conf_t *, ngx_command_t *, void *);
+static char *ngx_http_pta_set_zone (ngx_conf_t *, ngx_command_t *, void *);
+static char *ngx_http_pta_set_admin (ngx_conf_t *, ngx_command_t *, void *);
+static char *ngx_http_pta_set_status (ngx_conf_t *, ngx_command_t *, void *);
+static char *ngx_http_pta_set_overload (ngx_conf_t *, ngx_command_t *,
+                                        void *);
+static char *ngx_http_pta_set_ticket_key (ngx_conf_t *, ngx_command_t *,
+                                          void *);
+static char *ngx_http_pta_set_session_ticket (ngx_conf_t *, ngx_command_t *,
+                                              void *);
+static char *ngx_http_pta_set_assertion_key (ngx_conf_t *, ngx_command_t *,
+                                             void *);
+static char *ngx_http_pta_set_assertion (ngx_conf_t *, ngx_command_t *,
+                                         void *);
+static char *ngx_http_pta_set_renew_within (ngx_conf_t *, ngx_command_t *,
+                                            void *);
+static char *ngx_http_pta_set_rate (ngx_conf_t *, ngx_command_t *, void *);
+static char *ngx_http_pta_set_fail_threshold (ngx_conf_t *, ngx_command_t *,
+                                              void *);
+static ngx_int_t ngx_http_pta_header_filter (ngx_http_request_t *);
+static void ngx_http_pta_count (ngx_http_request_t *,
+                                ngx_http_pta_loc_conf_t *, ngx_uint_t);
+static void ngx_http_pta_count_outcome (ngx_http_request_t *,
+                                        ngx_http_pta_loc_conf_t *, ngx_int_t,
+                                        ngx_uint_t, ngx_uint_t);
+static ngx_int_t ngx_http_pta_stat_init (ngx_conf_t *,
+                                         ngx_http_pta_main_conf_t *);
+static uint8_t ngx_http_pta_timing_sampled (ngx_http_request_t *);
+static void ngx_http_pta_timing_add (ngx_http_request_t *,
+                                     ngx_http_pta_info_t *, ngx_uint_t,
+                                     uint64_t);
+static void ngx_http_pta_timing_save (ngx_http_request_t *,
+                                      ngx_http_pta_info_t *);
+static ngx_int_t ngx_http_pta_add_variables (ngx_conf_t *);
+static ngx_int_t ngx_http_pta_init_process (ngx_cycle_t *);
+
+static ngx_inline uint64_t
+ngx_http_pta_clock (void)
+{
+    struct timespec ts;
+
+#if defined(CLOCK_MONOTONIC_RAW)
+    (void) clock_gettime (CLOCK_MONOTONIC_RAW, &ts);
+#else
+    (void) clock_gettime (CLOCK_MONOTONIC, &ts);
+#endif
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// no clock is read unless the verification is sampled
+#define ngx_http_pta_timing_start(pta)                                      \
+    ((pta)->timed ? ngx_http_pta_clock () : 0)
+
+#define ngx_http_pta_timing_end(r, pta, stage, start)                       \
+    do                                                                      \
+      {                                                                     \
+          if ((pta)->timed)                                                 \
+            {                                                               \
+                ngx_http_pta_timing_add (r, pta, stage, start);             \
+            }                                                               \
+      }                                                                     \
+    while (0)
+
+static ngx_http_output_header_filter_pt ngx_http_next_header_filter;
+static ngx_http_request_body_filter_pt ngx_http_next_request_body_filter;
 
 #define NGX_IIJPTA_AUTH_QS          0x0002
 #define NGX_IIJPTA_AUTH_COOKIE      0x0004
+#define NGX_IIJPTA_AUTH_HEADER      0x0008
+#define NGX_IIJPTA_AUTH_PATH        0x0010
+#define NGX_IIJPTA_AUTH_BODY        0x0020
 
 #define NGX_HTTP_PTA_FALLBACK  21
+#define NGX_HTTP_PTA_READ_BODY  22
+
+static ngx_conf_num_bounds_t ngx_http_pta_cookie_max_candidates_bounds = {
+    ngx_conf_check_num_bounds, 1, NGX_HTTP_PTA_COOKIE_MAX
+};
 
 static ngx_conf_bitmask_t ngx_http_secure_token_iijpta_auth_method[] = {
     {ngx_string ("qs"), NGX_IIJPTA_AUTH_QS},
     {ngx_string ("cookie"), NGX_IIJPTA_AUTH_COOKIE},
+    {ngx_string ("header"), NGX_IIJPTA_AUTH_HEADER},
+    {ngx_string ("path"), NGX_IIJPTA_AUTH_PATH},
+    {ngx_string ("body"), NGX_IIJPTA_AUTH_BODY},
     {ngx_null_string, 0}
 };
 
+/* the order in which the methods of pta_auth_method are tried */
+static ngx_uint_t ngx_http_pta_auth_chain[] = {
+    NGX_IIJPTA_AUTH_PATH,
+    NGX_IIJPTA_AUTH_QS,
+    NGX_IIJPTA_AUTH_HEADER,
+    NGX_IIJPTA_AUTH_COOKIE,
+    NGX_IIJPTA_AUTH_BODY,
+    0
+};
+
+#define PTA_AUTH_HEADER  "X-PTA-Token"
+#define PTA_AUTH_PATH    "/pta/"
+
 static ngx_command_t ngx_http_pta_commands[] = {
+    {ngx_string ("pta_zone"),
+     NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE123,
+     ngx_http_pta_set_zone,
+     NGX_HTTP_MAIN_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_overload"),
+     NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+     ngx_http_pta_set_overload,
+     NGX_HTTP_MAIN_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_admin"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+     ngx_http_pta_set_admin,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_status"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+     ngx_http_pta_set_status,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_timing_sample"),
+     NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_num_slot,
+     NGX_HTTP_MAIN_CONF_OFFSET,
+     offsetof (ngx_http_pta_main_conf_t, timing_sample),
+     NULL},
     {ngx_string ("pta_1st_key"),
      NGX_HTTP_SRV_CONF | NGX_CONF_TAKE1,
      ngx_http_pta_set_1st_key,
@@ -109,20 +537,116 @@ static ngx_command_t ngx_http_pta_commands[] = {
      NULL},
     {ngx_string ("pta_auth_method"),
      NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
-     ngx_conf_set_bitmask_slot,
+     ngx_http_pta_set_auth_method,
      NGX_HTTP_LOC_CONF_OFFSET,
-     offsetof (ngx_http_pta_loc_conf_t, pta_auth_method),
+     0,
      &ngx_http_secure_token_iijpta_auth_method},
+    {ngx_string ("pta_cookie_max_candidates"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_num_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof (ngx_http_pta_loc_conf_t, cookie_max_candidates),
+     &ngx_http_pta_cookie_max_candidates_bounds},
+    {ngx_string ("pta_max_concurrent"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_num_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof (ngx_http_pta_loc_conf_t, max_concurrent),
+     NULL},
+    {ngx_string ("pta_rate"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+     ngx_http_pta_set_rate,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_fail_threshold"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+     ngx_http_pta_set_fail_threshold,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_cookie_max_scan"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_size_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof (ngx_http_pta_loc_conf_t, cookie_max_scan),
+     NULL},
+    {ngx_string ("pta_cache_control_from_deadline"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+     ngx_http_pta_set_cache_control,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_policy"),
+     NGX_HTTP_SRV_CONF | NGX_CONF_TAKE2,
+     ngx_http_pta_set_policy,
+     NGX_HTTP_SRV_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_revocation_file"),
+     NGX_HTTP_SRV_CONF | NGX_CONF_TAKE1,
+     ngx_http_pta_set_revocation_file,
+     NGX_HTTP_SRV_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_trusted"),
+     NGX_HTTP_SRV_CONF | NGX_CONF_1MORE,
+     ngx_http_pta_set_trusted,
+     NGX_HTTP_SRV_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_session_ticket_key"),
+     NGX_HTTP_SRV_CONF | NGX_CONF_TAKE1,
+     ngx_http_pta_set_ticket_key,
+     NGX_HTTP_SRV_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_session_ticket"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+     ngx_http_pta_set_session_ticket,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_assertion_key"),
+     NGX_HTTP_SRV_CONF | NGX_CONF_TAKE1,
+     ngx_http_pta_set_assertion_key,
+     NGX_HTTP_SRV_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_assertion"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+     ngx_http_pta_set_assertion,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     NULL},
+    {ngx_string ("pta_accept_assertion"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof (ngx_http_pta_loc_conf_t, accept_assertion),
+     NULL},
+    {ngx_string ("pta_enforce_deadline_during_response"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof (ngx_http_pta_loc_conf_t, enforce_deadline),
+     NULL},
+    {ngx_string ("pta_renew_within"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1234,
+     ngx_http_pta_set_renew_within,
+     NGX_HTTP_LOC_CONF_OFFSET,
+     0,
+     NULL},
 
     ngx_null_command
 };
 
 static ngx_http_module_t ngx_http_pta_module_ctx = {
-    NULL,                       /* preconfiguration */
+    ngx_http_pta_add_variables, /* preconfiguration */
     ngx_http_pta_init,          /* postconfiguration */
 
-    NULL,                       /* create main configuration */
-    NULL,                       /* init main configuration */
+    ngx_http_pta_create_main_conf,      /* create main configuration */
+    ngx_http_pta_init_main_conf,        /* init main configuration */
 
     ngx_http_pta_create_srv_conf,       /* create server configuration */
     NULL,                       /* merge server configuration */
@@ -138,7 +662,7 @@ ngx_module_t ngx_http_pta_module = {
     NGX_HTTP_MODULE,
     NULL,
     NULL,
-    NULL,
+    ngx_http_pta_init_process,
     NULL,
     NULL,
     NULL,
@@ -146,13 +670,18 @@ ngx_module_t ngx_http_pta_module = {
     NGX_MODULE_V1_PADDING
 };
 
-void
-ngx_http_pta_parse_cookie_header (ngx_http_request_t * r, ngx_str_t * name,
-                                  ngx_array_t * values)
+static void
+ngx_http_pta_parse_cookie_header (ngx_http_request_t * r,
+                                  ngx_http_pta_loc_conf_t * loc,
+                                  ngx_http_pta_info_t * pta)
 {
-    u_char *start, *last, *end, ch;
+    u_char *start, *end, *eq, *name, *last;
+    size_t budget, len;
+    ngx_uint_t truncated;
     ngx_str_t *value;
 
+    budget = loc->cookie_max_scan;
+
 #if nginx_version < 1023000
     ngx_array_t *headers;
     ngx_table_elt_t **h;
@@ -160,125 +689,255 @@ ngx_http_pta_parse_cookie_header (ngx_http_request_t * r, ngx_str_t * name,
     headers = &r->headers_in.cookies;
     h = headers->elts;
 
-    for (ngx_uint_t i = 0; i < headers->nelts; i++)
+    for (ngx_uint_t i = 0; i < headers->nelts && budget > 0; i++)
       {
           ngx_log_debug2 (NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                           "parse header: \"%V: %V\"", &h[i]->key,
                           &h[i]->value);
 
-          if (name->len > h[i]->value.len)
-            {
-                continue;
-            }
-
           start = h[i]->value.data;
-          end = h[i]->value.data + h[i]->value.len;
+          len = h[i]->value.len;
 #else
     ngx_table_elt_t *headers, *h;
 
     headers = r->headers_in.cookie;
 
-    for (h = headers; h != NULL; h = h->next)
+    for (h = headers; h != NULL && budget > 0; h = h->next)
       {
           ngx_log_debug2 (NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                           "parse header: \"%V: %V\"", &h->key,
                           &h->value);
 
-          if (name->len > h->value.len)
-            {
-                continue;
-            }
-
           start = h->value.data;
-          end = h->value.data + h->value.len;
+          len = h->value.len;
 #endif
 
+          truncated = (len > budget);
+          if (truncated)
+            {
+                len = budget;
+            }
+          budget -= len;
+          end = start + len;
+
+          // start always points to the beginning of a cookie; jump from
+          // there to its '=' and from the '=' over the value to the next ';'
           while (start < end)
             {
-                if (ngx_strncasecmp (start, name->data, name->len) != 0)
+                eq = memchr (start, '=', end - start);
+                if (eq == NULL)
                   {
-                      goto skip;
+                      break;
                   }
 
-                // skip space
-                for (start += name->len; start < end && *start == ' ';
-                     start++)
+                for (last = eq; last > start && *(last - 1) == ' '; last--)
                   {
                       /* void */
                   }
 
-                if (start == end || *start++ != '=')
-                  {
-                      goto skip;
-                  }
+                name = last - (sizeof (QUERY_PARAM) - 1);
 
-                // skip space
-                while (start < end && *start == ' ')
+                if (name >= start
+                    && ngx_strncasecmp (name, (u_char *) QUERY_PARAM,
+                                        sizeof (QUERY_PARAM) - 1) == 0)
                   {
-                      start++;
-                  }
+                      // skip space, the name must follow ';' or the
+                      // beginning of the header
+                      for (last = name; last > start && *(last - 1) == ' ';
+                           last--)
+                        {
+                            /* void */
+                        }
 
-                for (last = start; last < end && *last != ';'; last++)
-                  {
-                      /* void */
-                  }
+                      if (last != start && *(last - 1) != ';')
+                        {
+                            goto skip;
+                        }
+
+                      // skip space
+                      for (start = eq + 1; start < end && *start == ' ';
+                           start++)
+                        {
+                            /* void */
+                        }
 
-                value = ngx_array_push (values);
-                value->len = last - start;
-                value->data = start;
+                      last = memchr (start, ';', end - start);
+                      if (last == NULL)
+                        {
+                            if (truncated)
+                              {
+                                  // the value may be cut off by the budget
+                                  break;
+                              }
+                            last = end;
+                        }
 
-                continue;
+                      value =
+                          &pta->encrypt_data_array[pta->
+                                                   encrypt_data_array_nelts++];
+                      value->len = last - start;
+                      value->data = start;
+
+                      if (pta->encrypt_data_array_nelts
+                          >= loc->cookie_max_candidates)
+                        {
+                            return;
+                        }
+
+                      start = last + 1;
+                      continue;
+                  }
 
               skip:
 
-                while (start < end)
+                last = memchr (eq + 1, ';', end - (eq + 1));
+                if (last == NULL)
                   {
-                      ch = *start++;
-                      if (ch == ';')
-                        {
-                            break;
-                        }
+                      break;
                   }
 
-                // skip space
-                while (start < end && *start == ' ')
+                start = last + 1;
+            }
+      }
+}
+
+static ngx_int_t
+ngx_http_pta_parse_args (ngx_http_request_t * r, ngx_http_pta_info_t * pta)
+{
+    u_char *p, *last, *end;
+    size_t len = sizeof (QUERY_PARAM) - 1;
+
+    pta->qs_parsed = 1;
+
+    p = r->args.data;
+    last = p + r->args.len;
+
+    // one pass over the arguments: the first "pta" is the token and every
+    // occurrence is counted so that they can be removed after verification
+    while (p < last)
+      {
+          end = memchr (p, '&', last - p);
+          if (end == NULL)
+            {
+                end = last;
+            }
+
+          if ((size_t) (end - p) > len && p[len] == '='
+              && ngx_strncasecmp (p, (u_char *) QUERY_PARAM, len) == 0)
+            {
+                if (pta->qs_count++ == 0)
                   {
-                      start++;
+                      pta->qs_first = p;
+                      pta->encrypt_string.data = p + len + 1;
+                      pta->encrypt_string.len = end - p - len - 1;
                   }
             }
+
+          p = end + 1;
       }
+
+    return pta->qs_count ? NGX_OK : NGX_DECLINED;
 }
 
 static void
-ngx_http_pta_delete_arg (ngx_http_request_t * r)
-{
-    ngx_str_t target = ngx_string("pta");
-    ngx_str_t param;
-
-    while (r->args.data != NULL && r->args.len > 0 &&
-           ngx_http_arg(r, target.data, target.len, &param) == NGX_OK) {
-        u_char *beg = param.data - target.len - 1;
-        u_char *end = param.data + param.len;
-        if (r->args.data < beg && *(beg - 1) == '&') {
-            beg--;
-        } else if (*end == '&') {
-            end++;
-        }
-        // Remove target parameter key & value, and reduce the length of unparsed_uri.
-        // Note that if args is not part of unparsed_uri at this point,
-        // unparsed_uri will show strange values.
-        if (beg <= r->args.data && end >= r->args.data + r->args.len) {
-            // args is lost
-            r->unparsed_uri.len = r->args.data - r->unparsed_uri.data - 1;
-            r->args.len = 0;
-            r->args.data = NULL;
-        } else {
-            memmove(beg, end, r->args.len - (end - r->args.data));
-            size_t remove_size = end - beg;
-            r->args.len -= remove_size;
-            r->unparsed_uri.len -= remove_size;
-        }
-    }
+ngx_http_pta_delete_arg (ngx_http_request_t * r, ngx_http_pta_info_t * pta)
+{
+    u_char *src, *dst, *last, *end;
+    size_t len = sizeof (QUERY_PARAM) - 1;
+    size_t remove_size;
+
+    if (!pta->qs_parsed)
+      {
+          ngx_http_pta_parse_args (r, pta);
+      }
+
+    if (pta->qs_count == 0)
+      {
+          return;
+      }
+
+    // Compact the arguments from the first "pta" in a single forward copy.
+    // Note that if args is not part of unparsed_uri at this point,
+    // unparsed_uri will show strange values.
+    src = dst = pta->qs_first;
+    last = r->args.data + r->args.len;
+
+    while (src < last)
+      {
+          end = memchr (src, '&', last - src);
+          if (end == NULL)
+            {
+                end = last;
+            }
+
+          if ((size_t) (end - src) > len && src[len] == '='
+              && ngx_strncasecmp (src, (u_char *) QUERY_PARAM, len) == 0)
+            {
+                src = end + 1;
+                continue;
+            }
+
+          if (end < last)
+            {
+                end++;
+            }
+
+          dst = ngx_movemem (dst, src, end - src);
+          src = end;
+      }
+
+    if (dst > r->args.data && *(dst - 1) == '&')
+      {
+          dst--;
+      }
+
+    if (dst == r->args.data)
+      {
+          // args is lost
+          r->unparsed_uri.len = r->args.data - r->unparsed_uri.data - 1;
+          r->args.len = 0;
+          r->args.data = NULL;
+          return;
+      }
+
+    remove_size = r->args.len - (dst - r->args.data);
+    r->args.len -= remove_size;
+    r->unparsed_uri.len -= remove_size;
+}
+
+// "/pta/<token>/hls/a.m3u8" is cut into the token and "/hls/a.m3u8"
+// without copying: r->uri just starts after the token segment, and the
+// request goes through the location lookup again with the stripped uri
+static ngx_int_t
+ngx_http_pta_parse_path (ngx_http_request_t * r,
+                         ngx_http_pta_loc_conf_t * loc,
+                         ngx_http_pta_info_t * pta)
+{
+    u_char *token, *last;
+
+    if (r->uri.len <= loc->auth_path.len
+        || ngx_strncmp (r->uri.data, loc->auth_path.data,
+                        loc->auth_path.len) != 0)
+      {
+          return NGX_DECLINED;
+      }
+
+    token = r->uri.data + loc->auth_path.len;
+    last = ngx_strlchr (token, r->uri.data + r->uri.len, '/');
+    if (last == NULL || last == token)
+      {
+          return NGX_DECLINED;
+      }
+
+    pta->encrypt_string.data = token;
+    pta->encrypt_string.len = last - token;
+
+    r->uri.len -= last - r->uri.data;
+    r->uri.data = last;
+    r->uri_changed = 1;
+    r->valid_unparsed_uri = 0;
+
+    return NGX_OK;
 }
 
 static uint8_t
@@ -319,69 +978,275 @@ ngx_http_pta_hex2bin (u_char * hex, size_t len, uint8_t * bin)
     return 0;
 }
 
-static ngx_int_t
-ngx_http_pta_init (ngx_conf_t * cf)
+static ngx_inline ngx_uint_t
+ngx_http_pta_has_key (ngx_http_pta_srv_conf_t * srv, ngx_uint_t idx)
 {
-    ngx_http_handler_pt *h;
-    ngx_http_core_main_conf_t *cmcf;
+    return (idx == 0) ? (srv->key_1st.len && srv->iv_1st.len)
+        : (srv->key_2nd.len && srv->iv_2nd.len);
+}
 
-    cmcf = ngx_http_conf_get_module_main_conf (cf, ngx_http_core_module);
+// the last cipher block of cookie tokens that have been accepted by this
+// worker, which is random enough to be its own hash
+typedef struct
+{
+    uint8_t block[16];
+    uint8_t key;
+} ngx_http_pta_seen_t;
 
-    h = ngx_array_push (&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
-    if (h == NULL)
+static ngx_http_pta_seen_t ngx_http_pta_seen[64];
+
+static ngx_http_pta_seen_t *
+ngx_http_pta_seen_slot (ngx_str_t * token, uint8_t * block)
+{
+    if (token->len < 2 * 16
+        || ngx_http_pta_hex2bin (token->data + token->len - 2 * 16, 2 * 16,
+                                 block))
       {
-          return NGX_ERROR;
+          return NULL;
       }
 
-    *h = ngx_http_pta_handler;
-
-    return NGX_OK;
+    return &ngx_http_pta_seen[block[0] & 63];
 }
 
-static ngx_int_t
-ngx_http_pta_set_encrypt_data_array (ngx_http_request_t * r,
-                                     ngx_http_pta_info_t * pta)
+// scores a cookie token from its first block only: 4 if the path prefix
+// matches the uri, 2 if the deadline looks like one at all (a wrong key
+// gives a random 64-bit value) and 1 if it hasn't expired yet
+static ngx_uint_t
+ngx_http_pta_rank_block (ngx_http_request_t * r, uint8_t * plain,
+                         time_t now)
 {
-    ngx_str_t key = ngx_string ("pta");
+    ngx_uint_t score = 0, idx;
+    uint64_t deadline;
+    u_char c;
 
-    pta->encrypt_data_array = ngx_pcalloc (r->pool, sizeof (ngx_array_t));
-    if (pta->encrypt_data_array == NULL)
-      {
-          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
-                         "can't allocate memory for enctypt_data_array");
-          return NGX_HTTP_INTERNAL_SERVER_ERROR;
-      }
+    ngx_memcpy (&deadline, plain + 4, sizeof (deadline));
+    deadline = be64toh (deadline);
 
-    if (ngx_array_init
-        (pta->encrypt_data_array, r->pool, 3, sizeof (ngx_str_t)) != NGX_OK)
+    if ((deadline >> 34) == 0)
       {
-          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
-                         "can't init for enctypt_data_array");
-          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+          score += 2;
+          if ((time_t) deadline >= now)
+            {
+                score += 1;
+            }
       }
-    ngx_http_pta_parse_cookie_header (r, &key, pta->encrypt_data_array);
-    if (pta->encrypt_data_array->nelts == 0)
+
+    for (idx = 0; idx < 4; idx++)
       {
-          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
-                         "pta token is invalid #3");
-          return NGX_HTTP_BAD_REQUEST;
+          c = plain[12 + idx];
+          if (c == '*' || c == '?' || c == '\\')
+            {
+                break;
+            }
+          if (idx == r->uri.len)
+            {
+                // a path shorter than 4 bytes is followed by the padding
+                if (c > 16)
+                  {
+                      return score;
+                  }
+                break;
+            }
+          if (c != r->uri.data[idx])
+            {
+                return score;
+            }
       }
 
-    return NGX_OK;
+    return score + 4;
+}
+
+// orders the cookie tokens so the most promising one is decrypted first,
+// by a cache hit, or else by one AES block of each token with each key
+static void
+ngx_http_pta_rank_cookies (ngx_http_request_t * r,
+                           ngx_http_pta_info_t * pta)
+{
+    ngx_http_pta_srv_conf_t *srv;
+    ngx_http_pta_seen_t *seen;
+    EVP_CIPHER_CTX *ctx;
+    ngx_uint_t i, j, k, score[NGX_HTTP_PTA_COOKIE_MAX], best, s;
+    uint8_t block[16], plain[16];
+    ngx_str_t tmp;
+    uint8_t key;
+    time_t now;
+    int len;
+
+    srv = ngx_http_get_module_srv_conf (r, ngx_http_pta_module);
+    now = ngx_time ();
+
+    ctx = EVP_CIPHER_CTX_new ();
+    if (ctx == NULL)
+      {
+          return;
+      }
+
+    for (i = 0; i < pta->encrypt_data_array_nelts; i++)
+      {
+          score[i] = 0;
+          pta->encrypt_data_key[i] = 0;
+
+          seen = ngx_http_pta_seen_slot (&pta->encrypt_data_array[i], block);
+          if (seen != NULL && ngx_memcmp (seen->block, block, 16) == 0)
+            {
+                score[i] = 8;
+                pta->encrypt_data_key[i] = seen->key;
+                continue;
+            }
+
+          if (pta->encrypt_data_array[i].len < 2 * 16
+              || ngx_http_pta_hex2bin (pta->encrypt_data_array[i].data,
+                                       2 * 16, block))
+            {
+                continue;
+            }
+
+          best = 0;
+          for (k = 0; k < 2; k++)
+            {
+                if (!ngx_http_pta_has_key (srv, k)
+                    || !EVP_DecryptInit_ex (ctx, EVP_aes_128_cbc (), NULL,
+                                            srv->key_bin[k], srv->iv_bin[k])
+                    || !EVP_CIPHER_CTX_set_padding (ctx, 0)
+                    || !EVP_DecryptUpdate (ctx, plain, &len, block, 16)
+                    || len != 16)
+                  {
+                      continue;
+                  }
+
+                s = ngx_http_pta_rank_block (r, plain, now);
+                if (s > best)
+                  {
+                      best = s;
+                      pta->encrypt_data_key[i] = k;
+                  }
+            }
+          score[i] = best;
+      }
+
+    EVP_CIPHER_CTX_free (ctx);
+
+    // stable insertion sort, the header order breaks ties
+    for (i = 1; i < pta->encrypt_data_array_nelts; i++)
+      {
+          s = score[i];
+          tmp = pta->encrypt_data_array[i];
+          key = pta->encrypt_data_key[i];
+
+          for (j = i; j > 0 && score[j - 1] < s; j--)
+            {
+                score[j] = score[j - 1];
+                pta->encrypt_data_array[j] = pta->encrypt_data_array[j - 1];
+                pta->encrypt_data_key[j] = pta->encrypt_data_key[j - 1];
+            }
+
+          score[j] = s;
+          pta->encrypt_data_array[j] = tmp;
+          pta->encrypt_data_key[j] = key;
+      }
+}
+
+static void
+ngx_http_pta_remember_cookie (ngx_http_pta_info_t * pta)
+{
+    ngx_http_pta_seen_t *seen;
+    uint8_t block[16];
+
+    seen = ngx_http_pta_seen_slot (&pta->encrypt_string, block);
+    if (seen != NULL)
+      {
+          ngx_memcpy (seen->block, block, 16);
+          seen->key = pta->key_first;
+      }
+}
+
+static ngx_int_t
+ngx_http_pta_init (ngx_conf_t * cf)
+{
+    ngx_http_handler_pt *h;
+    ngx_http_core_main_conf_t *cmcf;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf (cf, ngx_http_core_module);
+
+    h = ngx_array_push (&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
+    if (h == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    *h = ngx_http_pta_handler;
+
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_pta_header_filter;
+
+    ngx_http_next_request_body_filter = ngx_http_top_request_body_filter;
+    ngx_http_top_request_body_filter = ngx_http_pta_request_body_filter;
+
+    // locations are known only after merging
+    pmcf = ngx_http_conf_get_module_main_conf (cf, ngx_http_pta_module);
+    if (pmcf->status && ngx_http_pta_stat_init (cf, pmcf) != NGX_OK)
+      {
+          return NGX_ERROR;
+      }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_pta_set_encrypt_data_array (ngx_http_request_t * r,
+                                     ngx_http_pta_loc_conf_t * loc,
+                                     ngx_http_pta_info_t * pta)
+{
+    ngx_http_pta_main_conf_t *pmcf;
+
+    ngx_http_pta_parse_cookie_header (r, loc, pta);
+    pta->cookie_parsed = 1;
+
+    if (pta->encrypt_data_array_nelts > 1)
+      {
+          ngx_http_pta_rank_cookies (r, pta);
+      }
+
+    // a cookie accepted before is ranked first, so it's still tried
+    if (pta->strict)
+      {
+          pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+          if (pta->encrypt_data_array_nelts > pmcf->overload_max_candidates)
+            {
+                pta->encrypt_data_array_nelts = pmcf->overload_max_candidates;
+            }
+      }
+
+    if (pta->encrypt_data_array_nelts == 0)
+      {
+          if (pta->auth_fallback)
+            {
+                return NGX_HTTP_PTA_FALLBACK;
+            }
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "pta token is invalid #3");
+          pta->reason = 3;
+          return NGX_HTTP_BAD_REQUEST;
+      }
+
+    return NGX_OK;
 }
 
 static ngx_int_t
-ngx_http_pta_build_info (ngx_http_request_t * r, ngx_http_pta_info_t * pta)
+ngx_http_pta_build_info (ngx_http_request_t * r,
+                         ngx_http_pta_loc_conf_t * loc,
+                         ngx_http_pta_info_t * pta)
 {
     ngx_int_t ret = 0;
+    uint64_t t;
+
+    t = ngx_http_pta_timing_start (pta);
 
     if (pta->auth_type == NGX_IIJPTA_AUTH_QS)
       {
-          pta->encrypt_data_array = NULL;
-          ret =
-              ngx_http_arg (r, (u_char *) QUERY_PARAM,
-                            sizeof (QUERY_PARAM) - 1, &pta->encrypt_string);
-          if (pta->need_fallback_cookie && ret)
+          ret = ngx_http_pta_parse_args (r, pta);
+          if (pta->auth_fallback && ret)
             {
                 return NGX_HTTP_PTA_FALLBACK;
             }
@@ -389,36 +1254,94 @@ ngx_http_pta_build_info (ngx_http_request_t * r, ngx_http_pta_info_t * pta)
             {
                 ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
                                "pta token is invalid #1");
+                pta->reason = 1;
+                return NGX_HTTP_BAD_REQUEST;
+            }
+      }
+    else if (pta->auth_type == NGX_IIJPTA_AUTH_HEADER)
+      {
+          ngx_http_variable_value_t *vv;
+
+          vv = ngx_http_get_indexed_variable (r, loc->auth_header_index);
+          if (vv == NULL)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+          if (vv->not_found || vv->len == 0)
+            {
+                if (pta->auth_fallback)
+                  {
+                      return NGX_HTTP_PTA_FALLBACK;
+                  }
+                ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                               "pta token is invalid #5");
+                pta->reason = 5;
+                return NGX_HTTP_BAD_REQUEST;
+            }
+          pta->encrypt_string.len = vv->len;
+          pta->encrypt_string.data = vv->data;
+      }
+    else if (pta->auth_type == NGX_IIJPTA_AUTH_PATH)
+      {
+          ret = ngx_http_pta_parse_path (r, loc, pta);
+          if (pta->auth_fallback && ret)
+            {
+                return NGX_HTTP_PTA_FALLBACK;
+            }
+          if (ret)
+            {
+                ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                               "pta token is invalid #6");
+                pta->reason = 6;
                 return NGX_HTTP_BAD_REQUEST;
             }
       }
     else if (pta->auth_type == NGX_IIJPTA_AUTH_COOKIE)
       {
-          if (pta->encrypt_data_array == NULL)
+          if (!pta->cookie_parsed)
             {
-                ret = ngx_http_pta_set_encrypt_data_array (r, pta);
+                ret = ngx_http_pta_set_encrypt_data_array (r, loc, pta);
                 if (ret != NGX_OK)
                   {
                       return ret;
                   }
             }
-          if (pta->encrypt_data_array_idx < pta->encrypt_data_array->nelts)
+          if (pta->encrypt_data_array_idx < pta->encrypt_data_array_nelts)
             {
-                pta->encrypt_string.data =
-                    ((ngx_str_t *) pta->encrypt_data_array->elts)[pta->
-                                                                  encrypt_data_array_idx].
-                    data;
-                pta->encrypt_string.len =
-                    ((ngx_str_t *) pta->encrypt_data_array->elts)[pta->
-                                                                  encrypt_data_array_idx].
-                    len;
+                pta->encrypt_string =
+                    pta->encrypt_data_array[pta->encrypt_data_array_idx];
+                pta->key_first =
+                    pta->encrypt_data_key[pta->encrypt_data_array_idx];
             }
           else
             {
                 ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
                                "pta token is invalid #4");
+                pta->reason = 4;
+                return NGX_HTTP_BAD_REQUEST;
+            }
+      }
+    else if (pta->auth_type == NGX_IIJPTA_AUTH_BODY)
+      {
+          ngx_http_pta_ctx_t *ctx;
+
+          // the body is read after the handler returns, and the token is
+          // verified again from the request body filter
+          ctx = ngx_http_get_module_ctx (r, ngx_http_pta_module);
+          if (ctx == NULL || !ctx->body_reading)
+            {
+                return NGX_HTTP_PTA_READ_BODY;
+            }
+          if (ctx->body_state != NGX_HTTP_PTA_BODY_FOUND
+              || ctx->body_token_len == 0)
+            {
+                ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                               "pta token is invalid #7");
+                pta->reason = 7;
                 return NGX_HTTP_BAD_REQUEST;
             }
+          pta->encrypt_string.data = ctx->body_token;
+          pta->encrypt_string.len = ctx->body_token_len;
       }
     else
       {
@@ -431,6 +1354,7 @@ ngx_http_pta_build_info (ngx_http_request_t * r, ngx_http_pta_info_t * pta)
       {
           ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
                          "pta token is invalid #2");
+          pta->reason = 2;
           return NGX_HTTP_BAD_REQUEST;
       }
 
@@ -442,8 +1366,14 @@ ngx_http_pta_build_info (ngx_http_request_t * r, ngx_http_pta_info_t * pta)
           return NGX_HTTP_INTERNAL_SERVER_ERROR;
       }
 
+    ngx_http_pta_timing_end (r, pta, NGX_HTTP_PTA_TIMING_BUILD, t);
+    t = ngx_http_pta_timing_start (pta);
+
     ret = ngx_http_pta_hex2bin (pta->encrypt_string.data,
                                 pta->encrypt_string.len, pta->encrypt_data);
+
+    ngx_http_pta_timing_end (r, pta, NGX_HTTP_PTA_TIMING_HEX, t);
+
     if (ret)
       {
           ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
@@ -455,473 +1385,5638 @@ ngx_http_pta_build_info (ngx_http_request_t * r, ngx_http_pta_info_t * pta)
 
     ngx_log_error (NGX_LOG_INFO, r->connection->log, 0,
                    "encrypt_string: %V auth_type: %s", &pta->encrypt_string,
-                   pta->auth_type ==
-                   NGX_IIJPTA_AUTH_QS ? "querystring" : "cookie");
+                   pta->auth_type == NGX_IIJPTA_AUTH_QS ? "querystring" :
+                   pta->auth_type == NGX_IIJPTA_AUTH_HEADER ? "header" :
+                   pta->auth_type == NGX_IIJPTA_AUTH_PATH ? "path" :
+                   pta->auth_type == NGX_IIJPTA_AUTH_BODY ? "body" :
+                   "cookie");
     return 0;
 }
 
+static void
+ngx_http_pta_next_auth_type (ngx_http_pta_info_t * pta)
+{
+    ngx_uint_t i;
+
+    pta->auth_type = 0;
+
+    for (i = 0; ngx_http_pta_auth_chain[i]; i++)
+      {
+          if (pta->auth_fallback & ngx_http_pta_auth_chain[i])
+            {
+                pta->auth_type = ngx_http_pta_auth_chain[i];
+                pta->auth_fallback &= ~ngx_http_pta_auth_chain[i];
+                return;
+            }
+      }
+}
+
 static ngx_int_t
 ngx_http_pta_init_auth_type (ngx_http_request_t * r,
                              ngx_http_pta_loc_conf_t * loc,
                              ngx_http_pta_info_t * pta)
 {
-    switch (loc->pta_auth_method)
-      {
-      case NGX_IIJPTA_AUTH_QS:
-          {
-              pta->auth_type = NGX_IIJPTA_AUTH_QS;
-              break;
-          }
-      case NGX_IIJPTA_AUTH_COOKIE:
-          {
-              pta->auth_type = NGX_IIJPTA_AUTH_COOKIE;
-              break;
-          }
-      case NGX_IIJPTA_AUTH_QS | NGX_IIJPTA_AUTH_COOKIE:
-          {
-              pta->need_fallback_cookie = 1;
-              pta->auth_type = NGX_IIJPTA_AUTH_QS;
-              break;
-          }
-      default:
-          {
-              pta->auth_type = NGX_IIJPTA_AUTH_QS;
-              break;
-          }
+    // methods are tried in the order of ngx_http_pta_auth_chain while the
+    // token is missing, and auth_fallback keeps the ones not tried yet
+    pta->auth_fallback = loc->pta_auth_method;
+    if (pta->auth_fallback == 0)
+      {
+          pta->auth_fallback = NGX_IIJPTA_AUTH_QS;
+      }
+
+    ngx_http_pta_next_auth_type (pta);
+
+    if (pta->strict)
+      {
+          pta->auth_fallback &= ~NGX_IIJPTA_AUTH_COOKIE;
       }
 
     return 0;
 }
 
+// bits of the per-worker bloom filter set by a fingerprint, which is
+// cipher text and so already uniformly distributed
+#define ngx_http_pta_bloom_bit(h1, h2, i, mask)  (((h1) + (i) * (h2)) & (mask))
+
+static void
+ngx_http_pta_bloom_hash (u_char * fp, uint32_t * h1, uint32_t * h2)
+{
+    *h1 = ((uint32_t) fp[0] << 24) | (fp[1] << 16) | (fp[2] << 8) | fp[3];
+    *h2 = (((uint32_t) fp[4] << 24) | (fp[5] << 16) | (fp[6] << 8) | fp[7])
+        | 1;
+}
+
 static ngx_int_t
-ngx_http_pta_decrypt (ngx_http_request_t * r, ngx_http_pta_srv_conf_t * srv,
-                      ngx_http_pta_info_t * pta)
+ngx_http_pta_revocation_load (ngx_http_pta_revocation_t * rv, ngx_log_t * log)
 {
-    int idx;
-    ngx_int_t ret;
-    u_char *hex;
-    size_t len;
-    uint8_t *out;
-    uint8_t key[16];
-    uint8_t iv[16];
-    int out_len = 0;
-    int last = 0;
-    EVP_CIPHER_CTX *ctx = NULL;
+    ngx_fd_t fd;
+    ngx_file_info_t fi;
+    u_char *map, *fp;
+    size_t size;
+    uint32_t version, nelts, bits, h1, h2, b;
+    uint64_t *bloom;
+    ngx_uint_t i, k;
+
+    fd = ngx_open_file (rv->name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE)
+      {
+          ngx_log_error (NGX_LOG_ERR, log, ngx_errno,
+                         ngx_open_file_n " \"%V\" failed", &rv->name);
+          return NGX_ERROR;
+      }
 
-  again:
-    ret = ngx_http_pta_build_info (r, pta);
-    if (ret == NGX_HTTP_PTA_FALLBACK)
+    if (ngx_fd_info (fd, &fi) == NGX_FILE_ERROR)
       {
-          pta->need_fallback_cookie = 0;
-          pta->auth_type = NGX_IIJPTA_AUTH_COOKIE;
-          goto again;
+          ngx_log_error (NGX_LOG_ERR, log, ngx_errno,
+                         ngx_fd_info_n " \"%V\" failed", &rv->name);
+          ngx_close_file (fd);
+          return NGX_ERROR;
       }
-    if (ret)
+
+    size = ngx_file_size (&fi);
+    if (size < NGX_HTTP_PTA_REVOCATION_HEADER)
       {
-          return ret;
+          goto invalid;
       }
 
-    out = ngx_pcalloc (r->pool, pta->encrypt_data_len);
-    if (out == NULL)
+    map = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    ngx_close_file (fd);
+    fd = NGX_INVALID_FILE;
+
+    if (map == MAP_FAILED)
       {
-          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
-                         "can't allocate memory");
-          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+          ngx_log_error (NGX_LOG_ERR, log, ngx_errno,
+                         "mmap(\"%V\") failed", &rv->name);
+          return NGX_ERROR;
       }
 
-    for (idx = 0; idx < 2; idx++)
+    version = ((uint32_t) map[4] << 24) | (map[5] << 16) | (map[6] << 8)
+        | map[7];
+    nelts = ((uint32_t) map[8] << 24) | (map[9] << 16) | (map[10] << 8)
+        | map[11];
+
+    if (ngx_memcmp (map, NGX_HTTP_PTA_REVOCATION_MAGIC, 4) != 0
+        || version != NGX_HTTP_PTA_REVOCATION_VERSION
+        || (size - NGX_HTTP_PTA_REVOCATION_HEADER)
+        / NGX_HTTP_PTA_FINGERPRINT_LEN < nelts)
       {
-          hex = (idx == 0) ? srv->key_1st.data : srv->key_2nd.data;
-          len = (idx == 0) ? srv->key_1st.len : srv->key_2nd.len;
-          ret = ngx_http_pta_hex2bin (hex, len, key);
-          if (ret)
-            {
-                continue;
-            }
+          munmap (map, size);
+          goto invalid;
+      }
 
-          hex = (idx == 0) ? srv->iv_1st.data : srv->iv_2nd.data;
-          len = (idx == 0) ? srv->iv_1st.len : srv->iv_2nd.len;
-          ret = ngx_http_pta_hex2bin (hex, len, iv);
-          if (ret)
-            {
-                continue;
-            }
-          ctx = EVP_CIPHER_CTX_new();
-          if (ctx == NULL)
-            {
-                goto fail;
-            }
-          if (!EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv))
-            {
-                goto fail;
-            }
-          if (!EVP_CIPHER_CTX_set_padding(ctx, 0))
-            {
-                goto fail;
-            }
-          if (!EVP_DecryptUpdate(ctx, out, &out_len, pta->encrypt_data, pta->encrypt_data_len))
-            {
-                goto fail;
-            }
-          if (!EVP_DecryptFinal_ex(ctx, out + out_len, &last))
-            {
-                goto fail;
-            }
+    // about 16 bits per fingerprint and 4 probes, < 0.3% false positives
+    for (bits = 1024; bits < (uint64_t) nelts * 16 && bits < 0x80000000;
+         bits <<= 1)
+      {
+          /* void */
+      }
 
-          pta->decrypt_data.crc = be32toh (*(uint32_t *) & out[0]);
-          pta->decrypt_data.deadline = *(time_t *) & out[4];
-          pta->decrypt_data.url = (u_char *) & out[12];
-          pta->decrypt_data.padding_val = out[pta->encrypt_data_len - 1];
+    bloom = ngx_alloc (bits / 8, log);
+    if (bloom == NULL)
+      {
+          munmap (map, size);
+          return NGX_ERROR;
+      }
+    ngx_memzero (bloom, bits / 8);
 
-          ret = ngx_http_pta_check_crc (pta);
-          if (ret == 0)
+    for (i = 0; i < nelts; i++)
+      {
+          fp = map + NGX_HTTP_PTA_REVOCATION_HEADER
+              + i * NGX_HTTP_PTA_FINGERPRINT_LEN;
+          ngx_http_pta_bloom_hash (fp, &h1, &h2);
+          for (k = 0; k < 4; k++)
             {
-                EVP_CIPHER_CTX_cleanup(ctx);
-                EVP_CIPHER_CTX_free(ctx);
-                return 0;
+                b = ngx_http_pta_bloom_bit (h1, h2, k, bits - 1);
+                bloom[b >> 6] |= (uint64_t) 1 << (b & 63);
             }
       }
 
-    if (pta->auth_type == NGX_IIJPTA_AUTH_COOKIE)
+    if (rv->map)
       {
-          pta->encrypt_data_array_idx++;
-          if (pta->encrypt_data_array_idx < pta->encrypt_data_array->nelts)
-            {
+          munmap (rv->map, rv->map_size);
+          ngx_free (rv->bloom);
+      }
 
-                if (ctx != NULL)
-                  {
-                      EVP_CIPHER_CTX_cleanup(ctx);
-                      EVP_CIPHER_CTX_free(ctx);
-                  }
-                ngx_log_error (NGX_LOG_INFO, r->connection->log, 0,
-                               "decrypt failed so checking next pta(index: %d)",
-                               pta->encrypt_data_array_idx);
-                goto again;
-            }
+    rv->map = map;
+    rv->map_size = size;
+    rv->list = map + NGX_HTTP_PTA_REVOCATION_HEADER;
+    rv->nelts = nelts;
+    rv->bloom = bloom;
+    rv->bloom_mask = bits - 1;
+    rv->mtime = ngx_file_mtime (&fi);
+    rv->size = ngx_file_size (&fi);
+    rv->uniq = ngx_file_uniq (&fi);
+
+    ngx_log_error (NGX_LOG_NOTICE, log, 0,
+                   "pta revocation file \"%V\" is loaded, %ui entries",
+                   &rv->name, rv->nelts);
+
+    return NGX_OK;
+
+  invalid:
+
+    if (fd != NGX_INVALID_FILE)
+      {
+          ngx_close_file (fd);
       }
 
-  fail:
-     if (ctx != NULL)
-       {
-           EVP_CIPHER_CTX_cleanup(ctx);
-           EVP_CIPHER_CTX_free(ctx);
-       }
-    ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
-                   "decrypt failed. check key and iv");
-    return 403;                 /* decrypt failed */
+    ngx_log_error (NGX_LOG_ERR, log, 0,
+                   "pta revocation file \"%V\" is invalid", &rv->name);
+
+    return NGX_ERROR;
 }
 
-static ngx_int_t
-ngx_http_pta_check_crc (ngx_http_pta_info_t * pta)
+static void
+ngx_http_pta_revocation_cleanup (void *data)
 {
-    uint8_t raw[8192];
-    size_t url_len;
-    uint32_t crc;
+    ngx_http_pta_revocation_t *rv = data;
 
-    if ((pta->decrypt_data.padding_val < 1)
-        || (16 < pta->decrypt_data.padding_val))
+    if (rv->map)
       {
-          return 1;
+          munmap (rv->map, rv->map_size);
+          ngx_free (rv->bloom);
+          rv->map = NULL;
       }
+}
 
-    url_len = pta->encrypt_data_len
-        - sizeof (pta->decrypt_data.crc)
-        - sizeof (pta->decrypt_data.deadline) - pta->decrypt_data.padding_val;
+static ngx_event_t ngx_http_pta_revocation_ev;
 
-    if (url_len > 8192)
+// Each worker looks at the files once a second, away from requests. A
+// broken or missing file leaves the previous list in use.
+static void
+ngx_http_pta_revocation_check (ngx_event_t * ev)
+{
+    ngx_uint_t i;
+    ngx_file_info_t fi;
+    ngx_http_pta_revocation_t **rvp, *rv;
+    ngx_http_pta_main_conf_t *pmcf = ev->data;
+
+    rvp = pmcf->revocations.elts;
+
+    for (i = 0; i < pmcf->revocations.nelts; i++)
       {
-          return 1;
+          rv = rvp[i];
+
+          if (ngx_file_info (rv->name.data, &fi) == NGX_FILE_ERROR)
+            {
+                if (!rv->missing)
+                  {
+                      ngx_log_error (NGX_LOG_ERR, ev->log, ngx_errno,
+                                     ngx_file_info_n " \"%V\" failed, "
+                                     "the previous revocation list is kept",
+                                     &rv->name);
+                      rv->missing = 1;
+                  }
+                continue;
+            }
+
+          rv->missing = 0;
+
+          if (ngx_file_mtime (&fi) != rv->mtime
+              || ngx_file_size (&fi) != rv->size
+              || ngx_file_uniq (&fi) != rv->uniq)
+            {
+                (void) ngx_http_pta_revocation_load (rv, ev->log);
+            }
       }
 
-    memcpy (raw, &pta->decrypt_data.deadline,
-            sizeof (pta->decrypt_data.deadline));
-    memcpy (raw + sizeof (pta->decrypt_data.deadline), pta->decrypt_data.url,
-            url_len);
+    if (!ngx_exiting && !ngx_quit)
+      {
+          ngx_add_timer (ev, 1000);
+      }
+}
 
-    crc = ngx_crc32_long (raw, sizeof (pta->decrypt_data.deadline) + url_len);
+static ngx_int_t
+ngx_http_pta_init_process (ngx_cycle_t * cycle)
+{
+    ngx_event_t *ev;
+    ngx_http_pta_main_conf_t *pmcf;
 
-    if (crc != pta->decrypt_data.crc)
+    pmcf = ngx_http_cycle_get_module_main_conf (cycle, ngx_http_pta_module);
+    if (pmcf == NULL || pmcf->revocations.nelts == 0)
       {
-          return 1;
+          return NGX_OK;
       }
 
+    ev = &ngx_http_pta_revocation_ev;
+    ev->handler = ngx_http_pta_revocation_check;
+    ev->data = pmcf;
+    ev->log = cycle->log;
+    ev->cancelable = 1;
+
+    ngx_add_timer (ev, 1000);
+
     return NGX_OK;
 }
 
 static ngx_int_t
-ngx_http_pta_check_deadline (ngx_http_pta_info_t * pta)
+ngx_http_pta_is_revoked (ngx_http_pta_revocation_t * rv, u_char * fp)
 {
-    time_t now, deadline;
+    u_char *elt;
+    uint32_t h1, h2, b;
+    ngx_uint_t k, lo, hi, mid;
+    ngx_int_t rc;
 
-    deadline = be64toh (pta->decrypt_data.deadline);
-    now = ngx_time ();
+    if (rv->nelts == 0)
+      {
+          return 0;
+      }
 
-    if (now > deadline)
+    ngx_http_pta_bloom_hash (fp, &h1, &h2);
+    for (k = 0; k < 4; k++)
       {
-          return 1;
+          b = ngx_http_pta_bloom_bit (h1, h2, k, rv->bloom_mask);
+          if (!(rv->bloom[b >> 6] & ((uint64_t) 1 << (b & 63))))
+            {
+                return 0;
+            }
+      }
+
+    lo = 0;
+    hi = rv->nelts;
+    while (lo < hi)
+      {
+          mid = lo + (hi - lo) / 2;
+          elt = rv->list + mid * NGX_HTTP_PTA_FINGERPRINT_LEN;
+          rc = ngx_memcmp (elt, fp, NGX_HTTP_PTA_FINGERPRINT_LEN);
+          if (rc == 0)
+            {
+                return 1;
+            }
+          if (rc < 0)
+            {
+                lo = mid + 1;
+            }
+          else
+            {
+                hi = mid;
+            }
       }
 
     return 0;
 }
 
+static ngx_inline uint64_t
+ngx_http_pta_fingerprint (u_char * fp)
+{
+    uint64_t v;
+    ngx_uint_t i;
+
+    v = 0;
+    for (i = 0; i < NGX_HTTP_PTA_FINGERPRINT_LEN; i++)
+      {
+          v = (v << 8) | fp[i];
+      }
+
+    // keeps clear of the values marking empty and deleted slots
+    return (v > NGX_HTTP_PTA_FP_DELETED) ? v : v | 0x8000000000000000ULL;
+}
+
 static ngx_int_t
-ngx_http_pta_check_wildcard_url (ngx_http_request_t * r,
-                                 ngx_http_pta_info_t * pta,
-                                 size_t wdx, size_t idx)
-{
-    u_char *beg = pta->decrypt_data.url + wdx + 1;
-    size_t len = 0;
-    while (*(beg + len) != pta->decrypt_data.padding_val) {
-        len++;
-    }
-    if (len == 0) {
-        // Trailing wildcard
-        return 0;
-    }
-    if (r->uri.len - idx < len) {
-        // Wildcards in the middle of a string require at least zero character
-        ngx_log_error (NGX_LOG_ERR, r->connection->log, 0, "wildcard mismatch: do not enough length.");
-        return 1;
-    }
-    if (ngx_strncmp(r->uri.data + r->uri.len - len, beg, len) == 0) {
-        return 0;
-    }
-    ngx_log_error (NGX_LOG_ERR, r->connection->log, 0, "wildcard mismatch: do not match string on the right side.");
-    return 1;
+ngx_http_pta_fingerprint_revoked (ngx_http_request_t * r, u_char * fp)
+{
+    uint64_t v, s, *slots;
+    ngx_uint_t i;
+    ngx_atomic_uint_t gen;
+    ngx_http_pta_fpset_t *set;
+    ngx_http_pta_zone_ctx_t *zctx;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+    if (pmcf->shm_zone == NULL)
+      {
+          return 0;
+      }
+
+    zctx = pmcf->shm_zone->data;
+    set = &zctx->sh->fingerprints;
+    if (set->nelts == 0)
+      {
+          return 0;
+      }
+
+    v = ngx_http_pta_fingerprint (fp);
+
+    do
+      {
+          gen = set->generation;
+          ngx_memory_barrier ();
+
+          // a table always has empty slots, so the probe ends
+          slots = *(uint64_t * volatile *) &set->slots;
+
+          for (i = ngx_http_pta_fp_slot (v, set->mask);;
+               i = (i + 1) & set->mask)
+            {
+                s = ((volatile uint64_t *) slots)[i];
+                if (s == v || s == NGX_HTTP_PTA_FP_EMPTY)
+                  {
+                      break;
+                  }
+            }
+
+          ngx_memory_barrier ();
+      }
+    while (set->generation != gen);
+
+    return s == v;
 }
 
+// a renewed token is revoked along with the one it was renewed from
 static ngx_int_t
-ngx_http_pta_check_url (ngx_http_request_t * r, ngx_http_pta_info_t * pta)
+ngx_http_pta_token_revoked (ngx_http_request_t * r,
+                            ngx_http_pta_srv_conf_t * srv,
+                            ngx_http_pta_info_t * pta)
+{
+    u_char *fp[2];
+    ngx_uint_t i, n;
+
+    if (pta->encrypt_data_len < NGX_HTTP_PTA_FINGERPRINT_LEN)
+      {
+          return 0;
+      }
+
+    n = 0;
+    fp[n++] = pta->encrypt_data + pta->encrypt_data_len
+        - NGX_HTTP_PTA_FINGERPRINT_LEN;
+    if (pta->decrypt_data.origin != NULL)
+      {
+          fp[n++] = pta->decrypt_data.origin;
+      }
+
+    for (i = 0; i < n; i++)
+      {
+          if ((srv->revocation
+               && ngx_http_pta_is_revoked (srv->revocation, fp[i]))
+              || ngx_http_pta_fingerprint_revoked (r, fp[i]))
+            {
+                return 1;
+            }
+      }
+
+    return 0;
+}
+
+static void
+ngx_http_pta_fingerprint_compact (ngx_http_pta_fpset_t * set)
+{
+    uint64_t s, *slots;
+    ngx_uint_t i, j;
+
+    // workers still probing the spare table left by the last compaction
+    // see the generation change and look again
+    set->generation++;
+    ngx_memory_barrier ();
+
+    slots = set->spare;
+    ngx_memzero (slots, (set->mask + 1) * sizeof (uint64_t));
+
+    for (i = 0; i <= set->mask; i++)
+      {
+          s = set->slots[i];
+          if (s <= NGX_HTTP_PTA_FP_DELETED)
+            {
+                continue;
+            }
+
+          for (j = ngx_http_pta_fp_slot (s, set->mask);
+               slots[j] != NGX_HTTP_PTA_FP_EMPTY; j = (j + 1) & set->mask)
+            {
+                /* void */
+            }
+          slots[j] = s;
+      }
+
+    ngx_memory_barrier ();
+    set->spare = set->slots;
+    set->slots = slots;
+    set->used = set->nelts;
+}
+
+static ngx_int_t
+ngx_http_pta_fingerprint_update (ngx_http_pta_zone_ctx_t * zctx, uint64_t v,
+                                 ngx_uint_t revoke)
+{
+    uint64_t s;
+    ngx_uint_t i, free;
+    ngx_http_pta_fpset_t *set;
+
+    set = &zctx->sh->fingerprints;
+
+    if (revoke && set->used >= set->limit && set->nelts < set->used)
+      {
+          ngx_http_pta_fingerprint_compact (set);
+      }
+
+    free = NGX_CONF_UNSET_UINT;
+
+    for (i = ngx_http_pta_fp_slot (v, set->mask);; i = (i + 1) & set->mask)
+      {
+          s = set->slots[i];
+          if (s == v)
+            {
+                if (!revoke)
+                  {
+                      set->slots[i] = NGX_HTTP_PTA_FP_DELETED;
+                      set->nelts--;
+                  }
+                return NGX_OK;
+            }
+          if (s == NGX_HTTP_PTA_FP_EMPTY)
+            {
+                break;
+            }
+          if (s == NGX_HTTP_PTA_FP_DELETED && free == NGX_CONF_UNSET_UINT)
+            {
+                free = i;
+            }
+      }
+
+    if (!revoke)
+      {
+          return NGX_OK;
+      }
+
+    if (free == NGX_CONF_UNSET_UINT)
+      {
+          if (set->used >= set->limit)
+            {
+                return NGX_ERROR;
+            }
+          free = i;
+          set->used++;
+      }
+
+    set->slots[free] = v;
+    set->nelts++;
+
+    return NGX_OK;
+}
+
+// one walk down the trie along the uri, whatever the number of prefixes
+static ngx_int_t
+ngx_http_pta_prefix_revoked (ngx_http_request_t * r)
+{
+    u_char *p, *last;
+    ngx_http_pta_prefix_t *node;
+    ngx_http_pta_zone_ctx_t *zctx;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+    if (pmcf->shm_zone == NULL)
+      {
+          return 0;
+      }
+
+    zctx = pmcf->shm_zone->data;
+    if (zctx->sh->nprefixes == 0)
+      {
+          return 0;
+      }
+
+    node = &zctx->sh->prefixes;
+    last = r->uri.data + r->uri.len;
+
+    for (p = r->uri.data; p < last; p++)
+      {
+          node = node->child[*p >> 4];
+          if (node == NULL)
+            {
+                return 0;
+            }
+          node = node->child[*p & 0xf];
+          if (node == NULL)
+            {
+                return 0;
+            }
+          if (node->revoked)
+            {
+                return 1;
+            }
+      }
+
+    return 0;
+}
+
+static ngx_int_t
+ngx_http_pta_prefix_update (ngx_http_pta_zone_ctx_t * zctx, u_char * prefix,
+                            size_t len, ngx_uint_t revoke)
+{
+    size_t i;
+    ngx_uint_t n;
+    ngx_http_pta_prefix_t *node, *child;
+
+    node = &zctx->sh->prefixes;
+
+    for (i = 0; i < len * 2; i++)
+      {
+          n = (i & 1) ? (prefix[i / 2] & 0xf) : (prefix[i / 2] >> 4);
+          child = node->child[n];
+          if (child == NULL)
+            {
+                if (!revoke)
+                  {
+                      return NGX_OK;
+                  }
+
+                child = ngx_slab_calloc_locked (zctx->shpool,
+                                                sizeof (ngx_http_pta_prefix_t));
+                if (child == NULL)
+                  {
+                      return NGX_ERROR;
+                  }
+
+                // readers see the node only once it's zeroed
+                ngx_memory_barrier ();
+                node->child[n] = child;
+            }
+          node = child;
+      }
+
+    if (node->revoked != revoke)
+      {
+          node->revoked = revoke;
+          if (revoke)
+            {
+                zctx->sh->nprefixes++;
+                zctx->sh->prefixes_size += len + 1;
+            }
+          else
+            {
+                zctx->sh->nprefixes--;
+                zctx->sh->prefixes_size -= len + 1;
+            }
+      }
+
+    return NGX_OK;
+}
+
+static u_char *
+ngx_http_pta_prefix_list (ngx_http_pta_prefix_t * node, u_char * path,
+                          size_t depth, u_char * p, u_char * last)
+{
+    ngx_uint_t n;
+
+    if (node->revoked && depth % 2 == 0)
+      {
+          if (p + depth / 2 + 1 > last)
+            {
+                return NULL;
+            }
+          p = ngx_cpymem (p, path, depth / 2);
+          *p++ = LF;
+      }
+
+    for (n = 0; n < 16; n++)
+      {
+          if (node->child[n] == NULL)
+            {
+                continue;
+            }
+
+          if (depth % 2 == 0)
+            {
+                path[depth / 2] = (u_char) (n << 4);
+            }
+          else
+            {
+                path[depth / 2] = (u_char) ((path[depth / 2] & 0xf0) | n);
+            }
+
+          p = ngx_http_pta_prefix_list (node->child[n], path, depth + 1, p,
+                                        last);
+          if (p == NULL)
+            {
+                return NULL;
+            }
+      }
+
+    return p;
+}
+
+static ngx_int_t
+ngx_http_pta_decrypt (ngx_http_request_t * r, ngx_http_pta_srv_conf_t * srv,
+                      ngx_http_pta_loc_conf_t * loc, ngx_http_pta_info_t * pta)
 {
-    size_t idx, wdx;
-    int ast;
+    ngx_uint_t n, idx;
+    ngx_int_t ret;
+    uint8_t *out;
+    int out_len = 0;
+    int last = 0;
+    uint64_t t;
+    EVP_CIPHER_CTX *ctx = NULL;
+    ngx_http_pta_main_conf_t *pmcf;
+
+  again:
+    // the reason a failure is counted with is that of the last candidate
+    pta->reason = 0;
+
+    ret = ngx_http_pta_build_info (r, loc, pta);
+    if (ret == NGX_HTTP_PTA_FALLBACK)
+      {
+          ngx_http_pta_next_auth_type (pta);
+          if (pta->auth_type == NGX_IIJPTA_AUTH_COOKIE)
+            {
+                ngx_http_pta_count (r, loc, NGX_HTTP_PTA_STAT_FALLBACK);
+            }
+          goto again;
+      }
+    if (ret)
+      {
+          return ret;
+      }
+
+    if (pta->auth_type == NGX_IIJPTA_AUTH_COOKIE)
+      {
+          ngx_http_pta_count (r, loc, NGX_HTTP_PTA_STAT_CANDIDATE);
+      }
+
+    if (pta->strict)
+      {
+          pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+          if (pta->encrypt_string.len > pmcf->overload_max_token)
+            {
+                ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                               "pta token is invalid #9");
+                pta->reason = 9;
+                return NGX_HTTP_BAD_REQUEST;
+            }
+      }
+
+    out = ngx_pcalloc (r->pool, pta->encrypt_data_len);
+    if (out == NULL)
+      {
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "can't allocate memory");
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    for (n = 0; n < (ngx_uint_t) (pta->strict ? 1 : 2); n++)
+      {
+          // the key the cookie was ranked with goes first
+          idx = n ^ pta->key_first;
+          if (!ngx_http_pta_has_key (srv, idx))
+            {
+                continue;
+            }
+          if (ctx == NULL)
+            {
+                ctx = EVP_CIPHER_CTX_new();
+                if (ctx == NULL)
+                  {
+                      goto fail;
+                  }
+            }
+          t = ngx_http_pta_timing_start (pta);
+          if (!EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, srv->key_bin[idx], srv->iv_bin[idx]))
+            {
+                goto fail;
+            }
+          if (!EVP_CIPHER_CTX_set_padding(ctx, 0))
+            {
+                goto fail;
+            }
+          if (!EVP_DecryptUpdate(ctx, out, &out_len, pta->encrypt_data, pta->encrypt_data_len))
+            {
+                goto fail;
+            }
+          if (!EVP_DecryptFinal_ex(ctx, out + out_len, &last))
+            {
+                goto fail;
+            }
+          ngx_http_pta_timing_end (r, pta, NGX_HTTP_PTA_TIMING_DECRYPT, t);
+
+          pta->decrypt_data.crc = be32toh (*(uint32_t *) & out[0]);
+          pta->decrypt_data.deadline = *(time_t *) & out[4];
+          pta->decrypt_data.url = (u_char *) & out[12];
+          pta->decrypt_data.padding_val = out[pta->encrypt_data_len - 1];
+
+          t = ngx_http_pta_timing_start (pta);
+          ret = ngx_http_pta_check_crc (pta);
+          ngx_http_pta_timing_end (r, pta, NGX_HTTP_PTA_TIMING_CRC, t);
+          if (ret == 0 && ngx_http_pta_token_revoked (r, srv, pta))
+            {
+                ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                               "pta token is revoked");
+                pta->reason = NGX_HTTP_PTA_REASON_REVOKED;
+                break;
+            }
+          if (ret == 0)
+            {
+                ngx_http_pta_count (r, loc, NGX_HTTP_PTA_STAT_KEY + idx);
+                pta->key_first = idx;
+                EVP_CIPHER_CTX_cleanup(ctx);
+                EVP_CIPHER_CTX_free(ctx);
+                return 0;
+            }
+      }
+
+    if (pta->auth_type == NGX_IIJPTA_AUTH_COOKIE)
+      {
+          pta->encrypt_data_array_idx++;
+          if (pta->encrypt_data_array_idx < pta->encrypt_data_array_nelts)
+            {
+
+                if (ctx != NULL)
+                  {
+                      EVP_CIPHER_CTX_cleanup(ctx);
+                      EVP_CIPHER_CTX_free(ctx);
+                      ctx = NULL;
+                  }
+                ngx_log_error (NGX_LOG_INFO, r->connection->log, 0,
+                               "decrypt failed so checking next pta(index: %d)",
+                               pta->encrypt_data_array_idx);
+                goto again;
+            }
+      }
+
+  fail:
+     if (ctx != NULL)
+       {
+           EVP_CIPHER_CTX_cleanup(ctx);
+           EVP_CIPHER_CTX_free(ctx);
+       }
+    ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                   "decrypt failed. check key and iv");
+    if (pta->reason == 0)
+      {
+          pta->reason = NGX_HTTP_PTA_REASON_DECRYPT;
+      }
+    return 403;                 /* decrypt failed */
+}
+
+static ngx_int_t
+ngx_http_pta_check_crc (ngx_http_pta_info_t * pta)
+{
+    uint8_t raw[8192];
+    u_char *p;
+    size_t url_len;
+    uint32_t crc;
+    uint64_t origin_deadline;
+
+    if ((pta->decrypt_data.padding_val < 1)
+        || (16 < pta->decrypt_data.padding_val))
+      {
+          return 1;
+      }
+
+    url_len = pta->encrypt_data_len
+        - sizeof (pta->decrypt_data.crc)
+        - sizeof (pta->decrypt_data.deadline) - pta->decrypt_data.padding_val;
+
+    if (url_len > 8192)
+      {
+          return 1;
+      }
+
+    memcpy (raw, &pta->decrypt_data.deadline,
+            sizeof (pta->decrypt_data.deadline));
+    memcpy (raw + sizeof (pta->decrypt_data.deadline), pta->decrypt_data.url,
+            url_len);
+
+    crc = ngx_crc32_long (raw, sizeof (pta->decrypt_data.deadline) + url_len);
+
+    if (crc != pta->decrypt_data.crc)
+      {
+          return 1;
+      }
+
+    pta->decrypt_data.origin = NULL;
+
+    p = pta->decrypt_data.url + url_len;
+    if (url_len >= NGX_HTTP_PTA_ORIGIN_LEN
+        && *(p - NGX_HTTP_PTA_ORIGIN_LEN) == '\0'
+        && *(p - NGX_HTTP_PTA_ORIGIN_LEN + 1) == '\0')
+      {
+          p -= NGX_HTTP_PTA_ORIGIN_LEN - 2;
+          pta->decrypt_data.origin = p;
+          p += NGX_HTTP_PTA_FINGERPRINT_LEN;
+          ngx_memcpy (&origin_deadline, p, sizeof (origin_deadline));
+          pta->decrypt_data.origin_deadline = be64toh (origin_deadline);
+          url_len -= NGX_HTTP_PTA_ORIGIN_LEN;
+      }
+
+    pta->decrypt_data.url_len = url_len;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_pta_check_deadline (ngx_http_pta_info_t * pta)
+{
+    time_t now, deadline;
+
+    deadline = be64toh (pta->decrypt_data.deadline);
+    now = ngx_time ();
+
+    if (now > deadline)
+      {
+          return 1;
+      }
+
+    return 0;
+}
+
+// the length of the run of literal characters at the start of pat
+static ngx_inline size_t
+ngx_http_pta_glob_literal (u_char * pat, size_t plen)
+{
+    size_t n;
+
+    for (n = 0; n < plen; n++)
+      {
+          if (pat[n] == '*' || pat[n] == '?'
+              || (pat[n] == '\\' && n + 1 < plen
+                  && (pat[n + 1] == '*' || pat[n + 1] == '?')))
+            {
+                break;
+            }
+      }
+
+    return n;
+}
+
+// Glob match of the uri against the token path, `*' for any string and
+// `?' for any single character, `\*' and `\?' for them literally. Greedy
+// with the position of the last `*' kept: when a literal mismatches, the
+// `*' takes one more character and the rest is matched again, and memchr
+// skips ahead to where the literal after the `*' occurs next. Runs of
+// literals are compared with memcmp, never past the end of the uri.
+static ngx_int_t
+ngx_http_pta_glob (u_char * pat, size_t plen, u_char * uri, size_t ulen)
+{
+    size_t i = 0, j = 0, si = 0, sj = 0, step, n;
+    ngx_uint_t star = 0;
+    u_char c, *next;
+
+    while (i < ulen)
+      {
+          if (j < plen)
+            {
+                c = pat[j];
+                step = 1;
+
+                if (c == '*')
+                  {
+                      while (j < plen && pat[j] == '*')
+                        {
+                            j++;
+                        }
+                      if (j == plen)
+                        {
+                            // trailing wildcard
+                            return 0;
+                        }
+                      n = ngx_http_pta_glob_literal (pat + j, plen - j);
+                      if (j + n == plen)
+                        {
+                            // only a literal suffix is left
+                            return (ulen - i >= n
+                                    && ngx_memcmp (uri + ulen - n, pat + j,
+                                                   n) == 0) ? 0 : 1;
+                        }
+                      star = 1;
+                      sj = j;
+                      si = i;
+                      continue;
+                  }
+
+                if (c == '\\' && j + 1 < plen
+                    && (pat[j + 1] == '*' || pat[j + 1] == '?'))
+                  {
+                      c = pat[j + 1];
+                      step = 2;
+                  }
+                else if (c == '?')
+                  {
+                      i++;
+                      j++;
+                      continue;
+                  }
+
+                if (step == 1)
+                  {
+                      n = ngx_http_pta_glob_literal (pat + j, plen - j);
+                      if (n <= ulen - i
+                          && ngx_memcmp (uri + i, pat + j, n) == 0)
+                        {
+                            i += n;
+                            j += n;
+                            continue;
+                        }
+                  }
+                else if (c == uri[i])
+                  {
+                      i++;
+                      j += step;
+                      continue;
+                  }
+            }
+
+          if (!star)
+            {
+                return 1;
+            }
+
+          si++;
+          c = pat[sj];
+          if (c == '\\' && sj + 1 < plen
+              && (pat[sj + 1] == '*' || pat[sj + 1] == '?'))
+            {
+                c = pat[sj + 1];
+            }
+          else if (c == '?')
+            {
+                c = '\0';
+            }
+
+          if (c != '\0' && si < ulen)
+            {
+                next = memchr (uri + si, c, ulen - si);
+                if (next == NULL)
+                  {
+                      return 1;
+                  }
+                si = next - uri;
+            }
+
+          i = si;
+          j = sj;
+      }
+
+    while (j < plen && pat[j] == '*')
+      {
+          j++;
+      }
+
+    return (j == plen) ? 0 : 1;
+}
+
+// As tokens have always been matched, everything from the first `\*' on
+// is literal, a `\*' in it standing for `*'. That part has to end the
+// uri, and the glob before it is matched against the rest.
+static ngx_int_t
+ngx_http_pta_match_glob (u_char * pat, size_t plen, u_char * uri, size_t ulen)
+{
+    u_char *tail, *p;
+    size_t k, tlen, n, i;
+
+    for (k = 0; k + 1 < plen; k++)
+      {
+          if (pat[k] == '\\' && pat[k + 1] == '*')
+            {
+                break;
+            }
+      }
+
+    if (k + 1 >= plen)
+      {
+          return ngx_http_pta_glob (pat, plen, uri, ulen);
+      }
+
+    tail = pat + k;
+    tlen = plen - k;
+
+    n = tlen;
+    for (i = 0; i + 1 < tlen; i++)
+      {
+          if (tail[i] == '\\' && tail[i + 1] == '*')
+            {
+                n--;
+                i++;
+            }
+      }
+
+    if (n > ulen)
+      {
+          return 1;
+      }
+
+    ulen -= n;
+    p = uri + ulen;
+
+    for (i = 0; i < tlen; i++)
+      {
+          if (tail[i] == '\\' && i + 1 < tlen && tail[i + 1] == '*')
+            {
+                i++;
+            }
+          if (*p++ != tail[i])
+            {
+                return 1;
+            }
+      }
+
+    return ngx_http_pta_glob (pat, k, uri, ulen);
+}
+
+// A path set is several paths separated by NUL. The literal prefixes of
+// the paths, up to the first wildcard, are put in a trie that is walked
+// along the uri once; where a prefix ends, the rest of that path is
+// matched against the rest of the uri.
+typedef struct
+{
+    u_char c;
+    uint16_t child;
+    uint16_t sibling;
+    uint16_t path;              /* paths ending here, index + 1 */
+} ngx_http_pta_trie_node_t;
+
+typedef struct
+{
+    u_char *rest;
+    size_t rest_len;
+    uint16_t next;              /* the other paths of the node, index + 1 */
+} ngx_http_pta_trie_path_t;
+
+static ngx_int_t
+ngx_http_pta_match_set (ngx_http_request_t * r, u_char * url, size_t len)
+{
+    ngx_http_pta_trie_node_t *node;
+    ngx_http_pta_trie_path_t *path;
+    ngx_uint_t nnodes, npaths, n, k, cur;
+    u_char *p, *last, *end;
+    size_t i, lit;
+
+    // the trie can't have more nodes than bytes in the path set
+    node = ngx_pcalloc (r->pool, (len + 1) * sizeof (*node));
+    path = ngx_pnalloc (r->pool, (len + 1) * sizeof (*path));
+    if (node == NULL || path == NULL)
+      {
+          return 1;
+      }
+
+    nnodes = 1;
+    npaths = 0;
+    last = url + len;
+
+    for (p = url; p < last; p = end + 1)
+      {
+          end = memchr (p, '\0', last - p);
+          if (end == NULL)
+            {
+                end = last;
+            }
+          if (end == p)
+            {
+                continue;
+            }
+
+          lit = ngx_http_pta_glob_literal (p, end - p);
+
+          cur = 0;
+          for (i = 0; i < lit; i++)
+            {
+                for (k = node[cur].child; k; k = node[k].sibling)
+                  {
+                      if (node[k].c == p[i])
+                        {
+                            break;
+                        }
+                  }
+                if (k == 0)
+                  {
+                      k = nnodes++;
+                      node[k].c = p[i];
+                      node[k].sibling = node[cur].child;
+                      node[cur].child = k;
+                  }
+                cur = k;
+            }
+
+          path[npaths].rest = p + lit;
+          path[npaths].rest_len = (end - p) - lit;
+          path[npaths].next = node[cur].path;
+          node[cur].path = ++npaths;
+      }
+
+    cur = 0;
+    for (i = 0;; i++)
+      {
+          for (n = node[cur].path; n; n = path[n - 1].next)
+            {
+                if (ngx_http_pta_match_glob (path[n - 1].rest,
+                                             path[n - 1].rest_len,
+                                             r->uri.data + i,
+                                             r->uri.len - i) == 0)
+                  {
+                      return 0;
+                  }
+            }
+
+          if (i == r->uri.len)
+            {
+                return 1;
+            }
+
+          for (k = node[cur].child; k; k = node[k].sibling)
+            {
+                if (node[k].c == r->uri.data[i])
+                  {
+                      break;
+                  }
+            }
+          if (k == 0)
+            {
+                return 1;
+            }
+          cur = k;
+      }
+}
+
+// The token path "@id" or "@id:param" refers to the pta_policy "id" of
+// the server, and param takes the place of $1 in a glob, or has to be
+// equal to the first capture of a regex.
+static ngx_int_t
+ngx_http_pta_match_policy (ngx_http_request_t * r, u_char * url, size_t len)
+{
+    ngx_http_pta_srv_conf_t *srv;
+    ngx_http_pta_policy_t *policy;
+    ngx_str_t id, param;
+    ngx_uint_t i, n;
+    u_char *p, *glob, c;
+    size_t glen;
+#if (NGX_PCRE)
+    int captures[6];
+    ngx_int_t rc;
+#endif
+
+    srv = ngx_http_get_module_srv_conf (r, ngx_http_pta_module);
+    if (srv->policies == NULL)
+      {
+          return 1;
+      }
+
+    id.data = url + 1;
+    p = ngx_strlchr (id.data, url + len, ':');
+    id.len = ((p == NULL) ? url + len : p) - id.data;
+    param.data = (p == NULL) ? NULL : p + 1;
+    param.len = (p == NULL) ? 0 : (size_t) (url + len - param.data);
+
+    // a parameter is a single path segment and has no wildcard
+    if (param.data != NULL && param.len == 0)
+      {
+          return 1;
+      }
+
+    for (i = 0; i < param.len; i++)
+      {
+          c = param.data[i];
+          if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')
+                || (c >= 'A' && c <= 'Z') || c == '-' || c == '_'
+                || c == '.'))
+            {
+                return 1;
+            }
+      }
+
+    policy = srv->policies->elts;
+    for (n = 0; n < srv->policies->nelts; n++)
+      {
+          if (policy[n].id.len == id.len
+              && ngx_strncmp (policy[n].id.data, id.data, id.len) == 0)
+            {
+                break;
+            }
+      }
+
+    if (n == srv->policies->nelts)
+      {
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "pta policy \"%V\" is unknown", &id);
+          return 1;
+      }
+
+    policy = &policy[n];
+    if (policy->param != (param.data != NULL))
+      {
+          return 1;
+      }
+
+#if (NGX_PCRE)
+    if (policy->regex)
+      {
+          rc = ngx_regex_exec (policy->regex, &r->uri, captures, 6);
+          if (rc == NGX_REGEX_NO_MATCHED)
+            {
+                return 1;
+            }
+          if (rc < 0)
+            {
+                ngx_log_error (NGX_LOG_ALERT, r->connection->log, 0,
+                               ngx_regex_exec_n " failed: %i on \"%V\"",
+                               rc, &r->uri);
+                return 1;
+            }
+          if (!policy->param)
+            {
+                return 0;
+            }
+          return (rc != 1 && captures[2] >= 0
+                  && (size_t) (captures[3] - captures[2]) == param.len
+                  && ngx_strncmp (r->uri.data + captures[2], param.data,
+                                  param.len) == 0) ? 0 : 1;
+      }
+#endif
+
+    if (!policy->param)
+      {
+          return ngx_http_pta_match_glob (policy->glob.data, policy->glob.len,
+                                          r->uri.data, r->uri.len);
+      }
+
+    glob = ngx_pnalloc (r->pool, policy->glob.len * (param.len + 1));
+    if (glob == NULL)
+      {
+          return 1;
+      }
+
+    glen = 0;
+    for (i = 0; i < policy->glob.len; i++)
+      {
+          if (policy->glob.data[i] == '$' && i + 1 < policy->glob.len
+              && policy->glob.data[i + 1] == '1')
+            {
+                glen = ngx_cpymem (glob + glen, param.data, param.len) - glob;
+                i++;
+                continue;
+            }
+          glob[glen++] = policy->glob.data[i];
+      }
+
+    return ngx_http_pta_match_glob (glob, glen, r->uri.data, r->uri.len);
+}
+
+static ngx_int_t
+ngx_http_pta_check_url (ngx_http_request_t * r, ngx_http_pta_info_t * pta)
+{
+    if (pta->decrypt_data.url_len > 0 && pta->decrypt_data.url[0] == '@')
+      {
+          if (ngx_http_pta_match_policy (r, pta->decrypt_data.url,
+                                         pta->decrypt_data.url_len))
+            {
+                ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                               "policy mismatch: %*s",
+                               pta->decrypt_data.url_len,
+                               pta->decrypt_data.url);
+                return 1;
+            }
+          return 0;
+      }
+
+    if (memchr (pta->decrypt_data.url, '\0', pta->decrypt_data.url_len))
+      {
+          if (ngx_http_pta_match_set (r, pta->decrypt_data.url,
+                                      pta->decrypt_data.url_len))
+            {
+                ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                               "no path of the set matches");
+                return 1;
+            }
+          return 0;
+      }
+
+    // url_len is the exact path length, set once the crc has been checked
+    if (ngx_http_pta_match_glob (pta->decrypt_data.url,
+                                 pta->decrypt_data.url_len,
+                                 r->uri.data, r->uri.len))
+      {
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "wildcard mismatch: %*s", pta->decrypt_data.url_len,
+                         pta->decrypt_data.url);
+          return 1;
+      }
+
+    return 0;
+}
+
+static ngx_int_t
+ngx_http_pta_mac (ngx_str_t * key, u_char * data, size_t len, u_char * mac)
+{
+    u_char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    ngx_str_t src, dst;
+
+    if (HMAC (EVP_sha256 (), key->data, key->len, data, len, md, &md_len)
+        == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    src.len = NGX_HTTP_PTA_MAC_LEN;
+    src.data = md;
+    dst.data = mac;
+
+    ngx_encode_base64url (&dst, &src);
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_pta_check_ticket (ngx_http_request_t * r,
+                           ngx_http_pta_srv_conf_t * srv, time_t * deadline)
+{
+    u_char *p, *mac;
+    u_char expect[NGX_HTTP_PTA_MAC_STR_LEN];
+    size_t len;
+    ngx_str_t name = ngx_string (TICKET_COOKIE);
+    ngx_str_t value, claim;
+    time_t t;
+
+    if (srv->ticket_key.len == 0)
+      {
+          return NGX_DECLINED;
+      }
+
+#if nginx_version < 1023000
+    if (ngx_http_parse_multi_header_lines (&r->headers_in.cookies, &name,
+                                           &value) == NGX_DECLINED)
+      {
+          return NGX_DECLINED;
+      }
+#else
+    if (ngx_http_parse_multi_header_lines (r, r->headers_in.cookie, &name,
+                                           &value) == NULL)
+      {
+          return NGX_DECLINED;
+      }
+#endif
+
+    // <deadline>:<claim>:<mac>
+    if (value.len < sizeof ("0:/:") - 1 + NGX_HTTP_PTA_MAC_STR_LEN)
+      {
+          goto invalid;
+      }
+
+    mac = value.data + value.len - NGX_HTTP_PTA_MAC_STR_LEN;
+    if (*(mac - 1) != ':')
+      {
+          goto invalid;
+      }
+
+    len = mac - 1 - value.data;
+    p = ngx_strlchr (value.data, value.data + len, ':');
+    if (p == NULL)
+      {
+          goto invalid;
+      }
+
+    if (ngx_http_pta_mac (&srv->ticket_key, value.data, len, expect)
+        != NGX_OK)
+      {
+          return NGX_DECLINED;
+      }
+
+    if (CRYPTO_memcmp (expect, mac, NGX_HTTP_PTA_MAC_STR_LEN) != 0)
+      {
+          goto invalid;
+      }
+
+    t = ngx_atotm (value.data, p - value.data);
+    if (t == NGX_ERROR || t < ngx_time ())
+      {
+          ngx_log_debug0 (NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                          "pta session ticket is expired");
+          return NGX_DECLINED;
+      }
+
+    claim.data = p + 1;
+    claim.len = mac - 1 - claim.data;
+
+    // the claim is the whole token path, wildcards included
+    if (claim.len == 0
+        || ngx_http_pta_match_glob (claim.data, claim.len, r->uri.data,
+                                    r->uri.len))
+      {
+          goto invalid;
+      }
+
+    *deadline = t;
+
+    return NGX_OK;
+
+  invalid:
+
+    ngx_log_debug1 (NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "pta session ticket is not usable: \"%V\"", &value);
+
+    return NGX_DECLINED;
+}
+
+static ngx_int_t
+ngx_http_pta_set_ticket (ngx_http_request_t * r,
+                         ngx_http_pta_srv_conf_t * srv,
+                         ngx_http_pta_loc_conf_t * loc,
+                         ngx_http_pta_info_t * pta)
+{
+    u_char *url, *buf, *p, *sig;
+    size_t url_len, claim_len, path_len, idx;
+    ngx_uint_t star;
+    time_t now, deadline;
+    ngx_table_elt_t *h;
+
+    if (srv->ticket_key.len == 0)
+      {
+          ngx_log_error (NGX_LOG_WARN, r->connection->log, 0,
+                         "pta_session_ticket_key is not set");
+          return NGX_OK;
+      }
+
+    url = pta->decrypt_data.url;
+    url_len = pta->decrypt_data.url_len;
+
+    // the claim is the whole token path, matched as the token itself is,
+    // and it has to fit in a cookie value as is. Policy tokens and sets
+    // get no ticket. The cookie path is the directory before the first
+    // wildcard.
+    if (url_len == 0 || url[0] != '/')
+      {
+          return NGX_OK;
+      }
+
+    claim_len = url_len;
+    path_len = 0;
+    star = 0;
+    for (idx = 0; idx < url_len; idx++)
+      {
+          if (url[idx] <= 0x20 || url[idx] >= 0x7f || url[idx] == '"'
+              || url[idx] == ',' || url[idx] == ';' || url[idx] == '\\'
+              || url[idx] == '?')
+            {
+                return NGX_OK;
+            }
+          if (url[idx] == '*')
+            {
+                star = 1;
+            }
+          if (url[idx] == '/' && !star)
+            {
+                path_len = idx + 1;
+            }
+      }
+
+    now = ngx_time ();
+    deadline = be64toh (pta->decrypt_data.deadline);
+    if (deadline > now + loc->session_ticket_ttl)
+      {
+          deadline = now + loc->session_ticket_ttl;
+      }
+
+    buf = ngx_pnalloc (r->pool, sizeof (TICKET_COOKIE "=") - 1
+                       + NGX_TIME_T_LEN + 1 + claim_len + 1
+                       + NGX_HTTP_PTA_MAC_STR_LEN
+                       + sizeof ("; Path=") - 1 + path_len
+                       + sizeof ("; Max-Age=") - 1 + NGX_TIME_T_LEN
+                       + sizeof ("; HttpOnly") - 1);
+    if (buf == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    sig = ngx_cpymem (buf, TICKET_COOKIE "=", sizeof (TICKET_COOKIE "=") - 1);
+    p = ngx_sprintf (sig, "%T:%*s", deadline, claim_len, url);
+
+    if (ngx_http_pta_mac (&srv->ticket_key, sig, p - sig, p + 1) != NGX_OK)
+      {
+          return NGX_ERROR;
+      }
+
+    *p++ = ':';
+    p += NGX_HTTP_PTA_MAC_STR_LEN;
+    p = ngx_sprintf (p, "; Path=%*s; Max-Age=%T; HttpOnly", path_len, url,
+                     deadline - now);
+
+    h = ngx_list_push (&r->headers_out.headers);
+    if (h == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    h->hash = 1;
+#if nginx_version >= 1023000
+    h->next = NULL;
+#endif
+    ngx_str_set (&h->key, "Set-Cookie");
+    h->value.len = p - buf;
+    h->value.data = buf;
+
+    return NGX_OK;
+}
+
+// <deadline>:<expires>:<mac>, where the mac covers the uri as well
+static u_char *
+ngx_http_pta_assertion_sign (ngx_http_request_t * r, ngx_str_t * key,
+                             time_t deadline, time_t expires, u_char * buf)
+{
+    u_char *p;
+
+    p = ngx_sprintf (buf, "%T:%T:%V", deadline, expires, &r->uri);
+
+    if (ngx_http_pta_mac (key, buf, p - buf, p) != NGX_OK)
+      {
+          return NULL;
+      }
+
+    return p;
+}
+
+static ngx_int_t
+ngx_http_pta_check_assertion (ngx_http_request_t * r,
+                              ngx_http_pta_srv_conf_t * srv,
+                              time_t * deadline)
+{
+    u_char *buf, *p, *mac;
+    ngx_uint_t i;
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h, *assertion;
+    time_t d, expires, now;
+
+    if (srv->assertion_key.len == 0)
+      {
+          return NGX_DECLINED;
+      }
+
+    assertion = NULL;
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0;; i++)
+      {
+          if (i >= part->nelts)
+            {
+                if (part->next == NULL)
+                  {
+                      break;
+                  }
+                part = part->next;
+                h = part->elts;
+                i = 0;
+            }
+
+          if (h[i].key.len == sizeof (ASSERTION_HEADER) - 1
+              && ngx_strncasecmp (h[i].key.data, (u_char *) ASSERTION_HEADER,
+                                  sizeof (ASSERTION_HEADER) - 1) == 0)
+            {
+                assertion = &h[i];
+                break;
+            }
+      }
+
+    if (assertion == NULL
+        || assertion->value.len < sizeof ("0:0:") - 1
+        + NGX_HTTP_PTA_MAC_STR_LEN)
+      {
+          return NGX_DECLINED;
+      }
+
+    mac = assertion->value.data + assertion->value.len
+        - NGX_HTTP_PTA_MAC_STR_LEN;
+    if (*(mac - 1) != ':')
+      {
+          goto invalid;
+      }
+
+    p = ngx_strlchr (assertion->value.data, mac - 1, ':');
+    if (p == NULL)
+      {
+          goto invalid;
+      }
+
+    d = ngx_atotm (assertion->value.data, p - assertion->value.data);
+    expires = ngx_atotm (p + 1, mac - 1 - (p + 1));
+    if (d == NGX_ERROR || expires == NGX_ERROR)
+      {
+          goto invalid;
+      }
+
+    buf = ngx_pnalloc (r->pool, 2 * NGX_TIME_T_LEN + 2 + r->uri.len
+                       + NGX_HTTP_PTA_MAC_STR_LEN);
+    if (buf == NULL)
+      {
+          return NGX_DECLINED;
+      }
+
+    p = ngx_http_pta_assertion_sign (r, &srv->assertion_key, d, expires, buf);
+    if (p == NULL)
+      {
+          return NGX_DECLINED;
+      }
+
+    // one hash call instead of decrypting a token
+    if (CRYPTO_memcmp (p, mac, NGX_HTTP_PTA_MAC_STR_LEN) != 0)
+      {
+          goto invalid;
+      }
+
+    now = ngx_time ();
+    if (expires < now || d < now)
+      {
+          ngx_log_debug0 (NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                          "pta assertion is expired");
+          return NGX_DECLINED;
+      }
+
+    *deadline = d;
+
+    return NGX_OK;
+
+  invalid:
+
+    ngx_log_debug1 (NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "pta assertion is not usable: \"%V\"",
+                    &assertion->value);
+
+    return NGX_DECLINED;
+}
+
+// passed to the upstream in the request headers, replacing any the client
+// has sent
+static ngx_int_t
+ngx_http_pta_set_assertion_header (ngx_http_request_t * r, time_t deadline)
+{
+    u_char *buf, *p;
+    ngx_uint_t i, found;
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h;
+    ngx_http_pta_srv_conf_t *srv;
+    ngx_http_pta_loc_conf_t *loc;
+
+    loc = ngx_http_get_module_loc_conf (r, ngx_http_pta_module);
+    if (!loc->assertion)
+      {
+          return NGX_OK;
+      }
+
+    srv = ngx_http_get_module_srv_conf (r, ngx_http_pta_module);
+    if (srv->assertion_key.len == 0)
+      {
+          ngx_log_error (NGX_LOG_WARN, r->connection->log, 0,
+                         "pta_assertion_key is not set");
+          return NGX_OK;
+      }
+
+    buf = ngx_pnalloc (r->pool, 2 * NGX_TIME_T_LEN + 2 + r->uri.len
+                       + NGX_HTTP_PTA_MAC_STR_LEN);
+    if (buf == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    p = ngx_http_pta_assertion_sign (r, &srv->assertion_key, deadline,
+                                     ngx_time () + loc->assertion_ttl, buf);
+    if (p == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    // the uri isn't part of the value, the mac takes its place
+    p = ngx_strlchr (ngx_strlchr (buf, p, ':') + 1, p, ':') + 1;
+    ngx_memmove (p, p + r->uri.len, NGX_HTTP_PTA_MAC_STR_LEN);
+    p += NGX_HTTP_PTA_MAC_STR_LEN;
+
+    found = 0;
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0;; i++)
+      {
+          if (i >= part->nelts)
+            {
+                if (part->next == NULL)
+                  {
+                      break;
+                  }
+                part = part->next;
+                h = part->elts;
+                i = 0;
+            }
+
+          if (h[i].key.len == sizeof (ASSERTION_HEADER) - 1
+              && ngx_strncasecmp (h[i].key.data, (u_char *) ASSERTION_HEADER,
+                                  sizeof (ASSERTION_HEADER) - 1) == 0)
+            {
+                h[i].value.len = p - buf;
+                h[i].value.data = buf;
+                found = 1;
+            }
+      }
+
+    if (found)
+      {
+          return NGX_OK;
+      }
+
+    h = ngx_list_push (&r->headers_in.headers);
+    if (h == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    ngx_str_set (&h->key, ASSERTION_HEADER);
+    h->lowcase_key = (u_char *) "x-pta-assertion";
+    h->hash = ngx_hash_key (h->lowcase_key, h->key.len);
+#if nginx_version >= 1023000
+    h->next = NULL;
+#endif
+    h->value.len = p - buf;
+    h->value.data = buf;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_pta_renew (ngx_http_request_t * r, ngx_http_pta_srv_conf_t * srv,
+                    ngx_http_pta_loc_conf_t * loc, ngx_http_pta_info_t * pta)
+{
+    u_char *plain, *out, *buf, *p, *path, *origin;
+    size_t url_len, plain_len, padded_len, path_len, idx;
+    time_t now, deadline, renewed, first;
+    uint64_t be_deadline;
+    uint32_t crc;
+    int out_len, last;
+    ngx_str_t key, value;
+    ngx_table_elt_t *h;
+    EVP_CIPHER_CTX *ctx;
+
+    now = ngx_time ();
+    deadline = be64toh (pta->decrypt_data.deadline);
+
+    // renewed tokens are tied to the first one, to be revoked with it and
+    // never renewed past pta_renew_within max after it expired
+    if (pta->decrypt_data.origin != NULL)
+      {
+          origin = pta->decrypt_data.origin;
+          first = pta->decrypt_data.origin_deadline;
+      }
+    else
+      {
+          origin = pta->encrypt_data + pta->encrypt_data_len
+              - NGX_HTTP_PTA_FINGERPRINT_LEN;
+          first = deadline;
+      }
+
+    renewed = ngx_min (now + loc->renew_lifetime, first + loc->renew_max);
+
+    if (deadline - now > loc->renew_within || renewed <= deadline)
+      {
+          return NGX_OK;
+      }
+
+    if (!ngx_http_pta_has_key (srv, 0))
+      {
+          return NGX_OK;
+      }
+
+    url_len = pta->decrypt_data.url_len;
+
+    // same layout as the token that has been accepted, with pkcs #7 padding
+    plain_len = sizeof (crc) + sizeof (be_deadline) + url_len
+        + NGX_HTTP_PTA_ORIGIN_LEN;
+    padded_len = (plain_len / 16 + 1) * 16;
+
+    plain = ngx_pnalloc (r->pool, padded_len * 2);
+    if (plain == NULL)
+      {
+          return NGX_ERROR;
+      }
+    out = plain + padded_len;
+
+    be_deadline = htobe64 ((uint64_t) renewed);
+    ngx_memcpy (plain + sizeof (crc), &be_deadline, sizeof (be_deadline));
+    p = ngx_cpymem (plain + sizeof (crc) + sizeof (be_deadline),
+                    pta->decrypt_data.url, url_len);
+    *p++ = '\0';
+    *p++ = '\0';
+    p = ngx_cpymem (p, origin, NGX_HTTP_PTA_FINGERPRINT_LEN);
+    be_deadline = htobe64 ((uint64_t) first);
+    ngx_memcpy (p, &be_deadline, sizeof (be_deadline));
+
+    crc = htobe32 (ngx_crc32_long (plain + sizeof (crc),
+                                   plain_len - sizeof (crc)));
+    ngx_memcpy (plain, &crc, sizeof (crc));
+    ngx_memset (plain + plain_len, padded_len - plain_len,
+                padded_len - plain_len);
+
+    ctx = EVP_CIPHER_CTX_new ();
+    if (ctx == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    if (!EVP_EncryptInit_ex (ctx, EVP_aes_128_cbc (), NULL, srv->key_bin[0],
+                             srv->iv_bin[0])
+        || !EVP_CIPHER_CTX_set_padding (ctx, 0)
+        || !EVP_EncryptUpdate (ctx, out, &out_len, plain, padded_len)
+        || !EVP_EncryptFinal_ex (ctx, out + out_len, &last))
+      {
+          EVP_CIPHER_CTX_free (ctx);
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "can't encrypt renewed pta token");
+          return NGX_ERROR;
+      }
+
+    EVP_CIPHER_CTX_free (ctx);
+
+    // the header is pushed only when its value is ready, so that a failed
+    // allocation doesn't leave a half-made one in the response
+    if (loc->renew_header.len)
+      {
+          buf = ngx_pnalloc (r->pool, padded_len * 2);
+          if (buf == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+          key = loc->renew_header;
+          value.data = buf;
+          value.len = ngx_hex_dump (buf, out, padded_len) - buf;
+      }
+    else
+      {
+          // the cookie is sent back for the directory of the token path,
+          // and for the whole site with a policy or a path set
+          path = pta->decrypt_data.url;
+          path_len = 0;
+          for (idx = 0; idx < url_len && path[0] == '/'; idx++)
+            {
+                if (path[idx] == '*' || path[idx] == '?' || path[idx] == '\\')
+                  {
+                      break;
+                  }
+                if (path[idx] == '\0')
+                  {
+                      path_len = 0;
+                      break;
+                  }
+                if (path[idx] == '/')
+                  {
+                      path_len = idx + 1;
+                  }
+            }
+
+          if (path_len == 0)
+            {
+                path = (u_char *) "/";
+                path_len = 1;
+            }
+
+          buf = ngx_pnalloc (r->pool, sizeof (QUERY_PARAM "=") - 1
+                             + padded_len * 2 + sizeof ("; Path=") - 1
+                             + path_len + sizeof ("; Max-Age=") - 1
+                             + NGX_TIME_T_LEN);
+          if (buf == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+          p = ngx_cpymem (buf, QUERY_PARAM "=", sizeof (QUERY_PARAM "=") - 1);
+          p = ngx_hex_dump (p, out, padded_len);
+          p = ngx_sprintf (p, "; Path=%*s; Max-Age=%T", path_len, path,
+                           renewed - now);
+
+          ngx_str_set (&key, "Set-Cookie");
+          value.data = buf;
+          value.len = p - buf;
+      }
+
+    h = ngx_list_push (&r->headers_out.headers);
+    if (h == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    h->hash = 1;
+#if nginx_version >= 1023000
+    h->next = NULL;
+#endif
+    h->key = key;
+    h->value = value;
+
+    ngx_log_error (NGX_LOG_INFO, r->connection->log, 0,
+                   "pta token is renewed until %T", renewed);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_pta_deadline_cleanup (void *data)
+{
+    ngx_event_t *ev = data;
+
+    if (ev->timer_set)
+      {
+          ngx_del_timer (ev);
+      }
+}
+
+static void
+ngx_http_pta_deadline_handler (ngx_event_t * ev)
+{
+    time_t now;
+    ngx_connection_t *c;
+    ngx_http_request_t *r;
+    ngx_http_pta_ctx_t *ctx;
+
+    r = ev->data;
+    c = r->connection;
+    ctx = ngx_http_get_module_ctx (r, ngx_http_pta_module);
+
+    // a far deadline is reached by several timers
+    now = ngx_time ();
+    if (ctx->deadline >= now)
+      {
+          ngx_add_timer (ev, (ngx_msec_t)
+                         ngx_min (ctx->deadline - now + 1,
+                                  NGX_HTTP_PTA_DEADLINE_TIMER_MAX) * 1000);
+          return;
+      }
+
+    ngx_log_error (NGX_LOG_INFO, c->log, 0,
+                   "pta token is expired during the response");
+
+    ngx_http_finalize_request (r, NGX_ERROR);
+    ngx_http_run_posted_requests (c);
+}
+
+static ngx_int_t
+ngx_http_pta_arm_deadline (ngx_http_request_t * r, ngx_http_pta_ctx_t * ctx)
+{
+    time_t now;
+    ngx_event_t *ev;
+    ngx_pool_cleanup_t *cln;
+    ngx_http_pta_loc_conf_t *loc;
+
+    loc = ngx_http_get_module_loc_conf (r, ngx_http_pta_module);
+    ev = &ctx->deadline_ev;
+    if (!loc->enforce_deadline || ev->timer_set || r != r->main)
+      {
+          return NGX_OK;
+      }
+
+    cln = ngx_pool_cleanup_add (r->pool, 0);
+    if (cln == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    cln->handler = ngx_http_pta_deadline_cleanup;
+    cln->data = ev;
+
+    ev->handler = ngx_http_pta_deadline_handler;
+    ev->data = r;
+    ev->log = r->connection->log;
+    // the connection keeps a worker from exiting, not the timer
+    ev->cancelable = 1;
+
+    now = ngx_time ();
+    ngx_add_timer (ev, (ngx_msec_t)
+                   ngx_min (ngx_max (ctx->deadline - now, 0) + 1,
+                            NGX_HTTP_PTA_DEADLINE_TIMER_MAX) * 1000);
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_pta_pass (ngx_http_request_t * r, ngx_http_pta_info_t * pta,
+                   time_t deadline)
+{
+    uint64_t t;
+    ngx_http_pta_ctx_t *ctx;
+
+    // the uri is stripped of a path token by now
+    if (ngx_http_pta_prefix_revoked (r))
+      {
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "pta uri is under a revoked prefix");
+          return 403;
+      }
+
+    if (deadline && ngx_http_pta_set_assertion_header (r, deadline) != NGX_OK)
+      {
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    ctx = ngx_http_get_module_ctx (r, ngx_http_pta_module);
+    if (ctx == NULL)
+      {
+          ctx = ngx_pcalloc (r->pool, sizeof (ngx_http_pta_ctx_t));
+          if (ctx == NULL)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+          ngx_http_set_ctx (r, ctx, ngx_http_pta_module);
+      }
+    ctx->deadline = deadline;
+    ctx->verified = 1;
+
+    if (deadline && ngx_http_pta_arm_deadline (r, ctx) != NGX_OK)
+      {
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    t = ngx_http_pta_timing_start (pta);
+    ngx_http_pta_delete_arg (r, pta);
+    ngx_http_pta_timing_end (r, pta, NGX_HTTP_PTA_TIMING_DELETE, t);
+
+    return NGX_DECLINED;
+}
+
+static ngx_int_t
+ngx_http_pta_verify (ngx_http_request_t * r, ngx_http_pta_srv_conf_t * srv,
+                     ngx_http_pta_loc_conf_t * loc, ngx_http_pta_info_t * pta)
+{
+    ngx_int_t ret;
+    uint64_t t;
+
+  more:
+    ret = ngx_http_pta_decrypt (r, srv, loc, pta);
+    if (ret)
+      {
+          return ret;
+      }
+
+    t = ngx_http_pta_timing_start (pta);
+
+    ret = ngx_http_pta_check_deadline (pta);
+    if (ret)
+      {
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "request is expired");
+          if (pta->auth_type == NGX_IIJPTA_AUTH_COOKIE)
+            {
+                pta->encrypt_data_array_idx++;
+                if (pta->encrypt_data_array_idx <
+                    pta->encrypt_data_array_nelts)
+                  {
+                      ngx_log_error (NGX_LOG_INFO, r->connection->log, 0,
+                                     "checking next pta(index: %d)",
+                                     pta->encrypt_data_array_idx);
+                      goto more;
+
+                  }
+            }
+          pta->reason = NGX_HTTP_PTA_REASON_EXPIRED;
+          return 410;
+      }
+
+    ret = ngx_http_pta_check_url (r, pta);
+    if (ret)
+      {
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0, "url is invalid");
+          if (pta->auth_type == NGX_IIJPTA_AUTH_COOKIE)
+            {
+                pta->encrypt_data_array_idx++;
+                if (pta->encrypt_data_array_idx <
+                    pta->encrypt_data_array_nelts)
+                  {
+                      ngx_log_error (NGX_LOG_INFO, r->connection->log, 0,
+                                     "checking next pta(index: %d)",
+                                     pta->encrypt_data_array_idx);
+                      goto more;
+                  }
+            }
+          pta->reason = NGX_HTTP_PTA_REASON_URL;
+          return 403;
+      }
+
+    ngx_http_pta_timing_end (r, pta, NGX_HTTP_PTA_TIMING_MATCH, t);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_pta_inflight_cleanup (void *data)
+{
+    ngx_http_pta_inflight_t *inflight = data;
+
+    (void) ngx_atomic_fetch_add (inflight->count[0], -1);
+    (void) ngx_atomic_fetch_add (inflight->count[1], -1);
+}
+
+static ngx_int_t
+ngx_http_pta_inflight_acquire (ngx_http_request_t * r,
+                               ngx_http_pta_loc_conf_t * loc,
+                               ngx_http_pta_info_t * pta)
+{
+    uint64_t v;
+    ngx_uint_t h1, h2, n1, n2;
+    ngx_pool_cleanup_t *cln;
+    ngx_http_pta_shctx_t *sh;
+    ngx_http_pta_inflight_t *inflight;
+    ngx_http_pta_zone_ctx_t *zctx;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+    zctx = pmcf->shm_zone->data;
+    sh = zctx->sh;
+
+    cln = ngx_pool_cleanup_add (r->pool, sizeof (ngx_http_pta_inflight_t));
+    if (cln == NULL)
+      {
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    v = ngx_http_pta_fingerprint (pta->encrypt_data + pta->encrypt_data_len
+                                  - NGX_HTTP_PTA_FINGERPRINT_LEN);
+
+    h1 = ngx_http_pta_fp_slot (v, sh->inflight_mask);
+    h2 = ngx_http_pta_fp_slot2 (v, sh->inflight_mask);
+    if (h2 == h1)
+      {
+          h2 ^= 1;
+      }
+
+    inflight = cln->data;
+    inflight->count[0] = &sh->inflight[h1];
+    inflight->count[1] = &sh->inflight[h2];
+
+    n1 = ngx_atomic_fetch_add (inflight->count[0], 1) + 1;
+    n2 = ngx_atomic_fetch_add (inflight->count[1], 1) + 1;
+
+    // decremented when the request is freed, whatever its outcome
+    cln->handler = ngx_http_pta_inflight_cleanup;
+
+    if (ngx_min (n1, n2) > loc->max_concurrent)
+      {
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "pta token is used by more than %ui requests",
+                         loc->max_concurrent);
+          return NGX_HTTP_SERVICE_UNAVAILABLE;
+      }
+
+    return NGX_OK;
+}
+
+#if (NGX_PTR_SIZE == 8)
+
+// the time and the excess share an atomic word, so pta_rate needs 64-bit
+// atomics
+
+static ngx_atomic_uint_t
+ngx_http_pta_rate_leak (ngx_atomic_uint_t state, uint32_t now,
+                        ngx_uint_t rate)
+{
+    int64_t excess;
+    uint32_t last, elapsed;
+
+    last = (uint32_t) (state >> 32);
+    elapsed = now - last;
+
+    // the time wraps every 49 days, so it's only known to be later than
+    // the last one when they are close. Another worker may have seen a
+    // slightly later time; anything else is a bucket left long enough to
+    // have drained, as is a fresh one.
+    if (last == 0 || ((int32_t) elapsed < 0 && last - now >= 1000))
+      {
+          excess = 0;
+      }
+    else
+      {
+          if ((int32_t) elapsed < 0)
+            {
+                elapsed = 0;
+                now = last;
+            }
+
+          excess = (int64_t) (state & 0xffffffff) + 1000
+              - (int64_t) ((uint64_t) rate * elapsed / 1000);
+          if (excess < 0)
+            {
+                excess = 0;
+            }
+      }
+
+    return ((ngx_atomic_uint_t) now << 32) | (uint32_t) excess;
+}
+
+static ngx_int_t
+ngx_http_pta_rate_check (ngx_http_request_t * r,
+                         ngx_http_pta_loc_conf_t * loc,
+                         ngx_http_pta_info_t * pta)
+{
+    uint64_t v;
+    uint32_t now;
+    ngx_uint_t i, over;
+    ngx_atomic_t *bucket[2];
+    ngx_atomic_uint_t old;
+    ngx_http_pta_shctx_t *sh;
+    ngx_http_pta_zone_ctx_t *zctx;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+    zctx = pmcf->shm_zone->data;
+    sh = zctx->sh;
+
+    v = ngx_http_pta_fingerprint (pta->encrypt_data + pta->encrypt_data_len
+                                  - NGX_HTTP_PTA_FINGERPRINT_LEN);
+
+    i = ngx_http_pta_fp_slot (v, sh->inflight_mask);
+    bucket[0] = &sh->rates[i];
+    bucket[1] = &sh->rates[ngx_http_pta_fp_slot2 (v, sh->inflight_mask)];
+    if (bucket[1] == bucket[0])
+      {
+          bucket[1] = &sh->rates[i ^ 1];
+      }
+
+    now = (uint32_t) ngx_current_msec;
+
+    over = 0;
+    for (i = 0; i < 2; i++)
+      {
+          if ((ngx_http_pta_rate_leak (*bucket[i], now, loc->rate)
+               & 0xffffffff) > loc->burst)
+            {
+                over++;
+            }
+      }
+
+    // a token is limited only when both of its buckets are full, and a
+    // refused request doesn't fill them further
+    if (over == 2)
+      {
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "pta token is used faster than pta_rate");
+          return NGX_HTTP_SERVICE_UNAVAILABLE;
+      }
+
+    for (i = 0; i < 2; i++)
+      {
+          do
+            {
+                old = *bucket[i];
+            }
+          while (!ngx_atomic_cmp_set (bucket[i], old,
+                                      ngx_http_pta_rate_leak (old, now,
+                                                              loc->rate)));
+      }
+
+    return NGX_OK;
+}
+
+#endif
+
+static ngx_int_t
+ngx_http_pta_accept (ngx_http_request_t * r, ngx_http_pta_srv_conf_t * srv,
+                     ngx_http_pta_loc_conf_t * loc, ngx_http_pta_info_t * pta)
+{
+    ngx_int_t ret;
+
+    ngx_log_error (NGX_LOG_DEBUG, r->connection->log, 0, "successful");
+
+#if (NGX_PTR_SIZE == 8)
+    if (loc->rate)
+      {
+          ret = ngx_http_pta_rate_check (r, loc, pta);
+          if (ret)
+            {
+                return ret;
+            }
+      }
+#endif
+
+    if (loc->max_concurrent)
+      {
+          ret = ngx_http_pta_inflight_acquire (r, loc, pta);
+          if (ret)
+            {
+                return ret;
+            }
+      }
+
+    if (pta->auth_type == NGX_IIJPTA_AUTH_COOKIE)
+      {
+          ngx_http_pta_remember_cookie (pta);
+      }
+
+    if (loc->session_ticket && pta->auth_type == NGX_IIJPTA_AUTH_QS)
+      {
+          if (ngx_http_pta_set_ticket (r, srv, loc, pta) != NGX_OK)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+      }
+
+    if (loc->renew_within)
+      {
+          if (ngx_http_pta_renew (r, srv, loc, pta) != NGX_OK)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+      }
+
+    return ngx_http_pta_pass (r, pta, be64toh (pta->decrypt_data.deadline));
+}
+
+#if (NGX_PTR_SIZE == 8)
+
+// the time and the count share an atomic word, so pta_fail_threshold
+// needs 64-bit atomics
+
+// the network of the client, hashed
+static ngx_int_t
+ngx_http_pta_fail_key (ngx_http_request_t * r, ngx_http_pta_loc_conf_t * loc,
+                       uint64_t * v)
+{
+    u_char key[17], *addr;
+    ngx_uint_t bits, i;
+    struct sockaddr_in *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6 *sin6;
+#endif
+
+    switch (r->connection->sockaddr->sa_family)
+      {
+      case AF_INET:
+          sin = (struct sockaddr_in *) r->connection->sockaddr;
+          addr = (u_char *) & sin->sin_addr.s_addr;
+          bits = loc->fail_ipv4_prefix;
+          key[0] = 4;
+          break;
+
+#if (NGX_HAVE_INET6)
+      case AF_INET6:
+          sin6 = (struct sockaddr_in6 *) r->connection->sockaddr;
+          addr = sin6->sin6_addr.s6_addr;
+          if (IN6_IS_ADDR_V4MAPPED (&sin6->sin6_addr))
+            {
+                addr += 12;
+                bits = loc->fail_ipv4_prefix;
+                key[0] = 4;
+                break;
+            }
+          bits = loc->fail_ipv6_prefix;
+          key[0] = 16;
+          break;
+#endif
+
+      default:
+          return NGX_DECLINED;
+      }
+
+    for (i = 0; i < key[0]; i++)
+      {
+          if (bits >= 8)
+            {
+                key[i + 1] = addr[i];
+                bits -= 8;
+            }
+          else
+            {
+                key[i + 1] = addr[i] & (u_char) (0xff00 >> bits);
+                bits = 0;
+            }
+      }
+
+    *v = ngx_murmur_hash2 (key, key[0] + 1);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_pta_fail_slots (ngx_http_request_t * r, uint64_t v,
+                         ngx_atomic_t ** slot)
+{
+    ngx_uint_t i;
+    ngx_http_pta_shctx_t *sh;
+    ngx_http_pta_zone_ctx_t *zctx;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+    zctx = pmcf->shm_zone->data;
+    sh = zctx->sh;
+
+    i = ngx_http_pta_fp_slot (v, sh->inflight_mask);
+    slot[0] = &sh->failures[i];
+    slot[1] = &sh->failures[ngx_http_pta_fp_slot2 (v, sh->inflight_mask)];
+    if (slot[1] == slot[0])
+      {
+          slot[1] = &sh->failures[i ^ 1];
+      }
+}
+
+#endif
+
+static ngx_int_t
+ngx_http_pta_overloaded (ngx_http_request_t * r)
+{
+    time_t now;
+    ngx_atomic_uint_t sec, n, rate;
+    ngx_http_pta_overload_t *ov;
+    ngx_http_pta_zone_ctx_t *zctx;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+    if (pmcf->overload_on == 0)
+      {
+          return 0;
+      }
+
+    zctx = pmcf->shm_zone->data;
+    ov = &zctx->sh->overload;
+
+    now = ngx_time ();
+    sec = ov->sec;
+
+    if ((time_t) sec == now || !ngx_atomic_cmp_set (&ov->sec, sec, now))
+      {
+          return ov->active;
+      }
+
+    // failures counted while this is done are left to the next second
+    n = ov->failures;
+    (void) ngx_atomic_fetch_add (&ov->failures, -(ngx_atomic_int_t) n);
+    rate = (now - (time_t) sec > 1) ? n / (now - sec) : n;
+
+    if (!ov->active)
+      {
+          if (rate >= pmcf->overload_on)
+            {
+                ov->active = 1;
+                ov->calm_since = 0;
+                (void) ngx_atomic_fetch_add (&ov->entered, 1);
+                ngx_log_error (NGX_LOG_WARN, r->connection->log, 0,
+                               "pta overload mode is on, %uA failures/s",
+                               rate);
+            }
+      }
+    else if (rate >= pmcf->overload_off)
+      {
+          ov->calm_since = 0;
+      }
+    else if (ov->calm_since == 0)
+      {
+          ov->calm_since = now;
+      }
+    else if (now - (time_t) ov->calm_since >= pmcf->overload_hold)
+      {
+          ov->active = 0;
+          ngx_log_error (NGX_LOG_WARN, r->connection->log, 0,
+                         "pta overload mode is off");
+      }
+
+    return ov->active;
+}
+
+#if (NGX_PTR_SIZE == 8)
+
+// checked before the token is even looked for, so that a boxed client
+// costs no crypto
+static ngx_int_t
+ngx_http_pta_fail_boxed (ngx_http_request_t * r,
+                         ngx_http_pta_loc_conf_t * loc)
+{
+    uint64_t v;
+    uint32_t now;
+    ngx_uint_t i;
+    ngx_atomic_uint_t state;
+    ngx_atomic_t *slot[2];
+
+    if (ngx_http_pta_fail_key (r, loc, &v) != NGX_OK)
+      {
+          return 0;
+      }
+
+    ngx_http_pta_fail_slots (r, v, slot);
+    now = (uint32_t) ngx_time ();
+
+    for (i = 0; i < 2; i++)
+      {
+          state = *slot[i];
+          if (!(state & NGX_HTTP_PTA_FAIL_BOXED)
+              || now - (uint32_t) (state >> 32) >= (uint32_t) loc->fail_penalty)
+            {
+                return 0;
+            }
+      }
+
+    return 1;
+}
+
+static void
+ngx_http_pta_fail_count (ngx_http_request_t * r,
+                         ngx_http_pta_loc_conf_t * loc)
+{
+    uint64_t v;
+    uint32_t now, since, count;
+    ngx_uint_t i;
+    ngx_atomic_uint_t old, state;
+    ngx_atomic_t *slot[2];
+
+    if (ngx_http_pta_fail_key (r, loc, &v) != NGX_OK)
+      {
+          return;
+      }
+
+    ngx_http_pta_fail_slots (r, v, slot);
+    now = (uint32_t) ngx_time ();
+
+    for (i = 0; i < 2; i++)
+      {
+          do
+            {
+                old = *slot[i];
+                since = (uint32_t) (old >> 32);
+                count = (uint32_t) old & NGX_HTTP_PTA_FAIL_COUNT;
+
+                if (old & NGX_HTTP_PTA_FAIL_BOXED)
+                  {
+                      if (now - since < (uint32_t) loc->fail_penalty)
+                        {
+                            break;
+                        }
+                      since = now;
+                      count = 0;
+                  }
+                else if (now - since >= (uint32_t) loc->fail_window)
+                  {
+                      since = now;
+                      count = 0;
+                  }
+
+                count++;
+
+                if (count >= loc->fail_threshold)
+                  {
+                      state = ((ngx_atomic_uint_t) now << 32)
+                          | NGX_HTTP_PTA_FAIL_BOXED;
+                  }
+                else
+                  {
+                      state = ((ngx_atomic_uint_t) since << 32) | count;
+                  }
+            }
+          while (!ngx_atomic_cmp_set (slot[i], old, state));
+      }
+}
+
+#endif
+
+static void
+ngx_http_pta_fail (ngx_http_request_t * r, ngx_http_pta_loc_conf_t * loc,
+                   ngx_int_t status)
+{
+    ngx_http_pta_zone_ctx_t *zctx;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    if (status != NGX_HTTP_BAD_REQUEST && status != 403 && status != 410)
+      {
+          return;
+      }
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+    if (pmcf->overload_on)
+      {
+          zctx = pmcf->shm_zone->data;
+          (void) ngx_atomic_fetch_add (&zctx->sh->overload.failures, 1);
+      }
+
+#if (NGX_PTR_SIZE == 8)
+    if (loc->fail_threshold)
+      {
+          ngx_http_pta_fail_count (r, loc);
+      }
+#endif
+}
+
+static ngx_int_t
+ngx_http_pta_is_trusted (ngx_http_request_t * r,
+                         ngx_http_pta_srv_conf_t * srv)
+{
+    struct sockaddr_in *sin;
+#if (NGX_HAVE_INET6)
+    u_char *p;
+    in_addr_t addr;
+    struct sockaddr_in6 *sin6;
+#endif
+
+    switch (r->connection->sockaddr->sa_family)
+      {
+      case AF_INET:
+          sin = (struct sockaddr_in *) r->connection->sockaddr;
+          return ngx_radix32tree_find (srv->trusted,
+                                       ntohl (sin->sin_addr.s_addr))
+              != NGX_RADIX_NO_VALUE;
+
+#if (NGX_HAVE_INET6)
+      case AF_INET6:
+          sin6 = (struct sockaddr_in6 *) r->connection->sockaddr;
+
+          if (IN6_IS_ADDR_V4MAPPED (&sin6->sin6_addr))
+            {
+                p = sin6->sin6_addr.s6_addr;
+                addr = (in_addr_t) p[12] << 24;
+                addr |= p[13] << 16;
+                addr |= p[14] << 8;
+                addr |= p[15];
+
+                return ngx_radix32tree_find (srv->trusted, addr)
+                    != NGX_RADIX_NO_VALUE;
+            }
+
+          return ngx_radix128tree_find (srv->trusted6,
+                                        sin6->sin6_addr.s6_addr)
+              != NGX_RADIX_NO_VALUE;
+#endif
+
+      default:
+          return 0;
+      }
+}
+
+// "pta=" is looked for at the start of each form field, across buffer
+// boundaries, and only the value of the first one is kept
+static ngx_int_t
+ngx_http_pta_body_scan (ngx_http_pta_ctx_t * ctx, u_char * p, u_char * last)
+{
+    u_char *end;
+    size_t len;
+    static u_char name[] = QUERY_PARAM "=";
+
+    while (p < last)
+      {
+          switch (ctx->body_state)
+            {
+            case NGX_HTTP_PTA_BODY_NAME:
+                if (*p == '&')
+                  {
+                      ctx->body_match = 0;
+                      p++;
+                      break;
+                  }
+                if (ngx_tolower (*p) != name[ctx->body_match])
+                  {
+                      ctx->body_state = NGX_HTTP_PTA_BODY_SKIP;
+                      break;
+                  }
+                p++;
+                if (++ctx->body_match == sizeof (name) - 1)
+                  {
+                      ctx->body_state = NGX_HTTP_PTA_BODY_VALUE;
+                  }
+                break;
+
+            case NGX_HTTP_PTA_BODY_SKIP:
+                end = memchr (p, '&', last - p);
+                if (end == NULL)
+                  {
+                      return NGX_OK;
+                  }
+                p = end + 1;
+                ctx->body_state = NGX_HTTP_PTA_BODY_NAME;
+                ctx->body_match = 0;
+                break;
+
+            case NGX_HTTP_PTA_BODY_VALUE:
+                end = memchr (p, '&', last - p);
+                len = ((end == NULL) ? last : end) - p;
+                if (ctx->body_token_len + len > NGX_HTTP_PTA_BODY_TOKEN_MAX)
+                  {
+                      return NGX_ERROR;
+                  }
+                ngx_memcpy (ctx->body_token + ctx->body_token_len, p, len);
+                ctx->body_token_len += len;
+                if (end == NULL)
+                  {
+                      return NGX_OK;
+                  }
+                ctx->body_state = NGX_HTTP_PTA_BODY_FOUND;
+                return NGX_OK;
+
+            default:
+                return NGX_OK;
+            }
+      }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_pta_body_verify (ngx_http_request_t * r)
+{
+    ngx_int_t ret;
+    ngx_http_pta_srv_conf_t *srv;
+    ngx_http_pta_loc_conf_t *loc;
+    ngx_http_pta_info_t pta;
+
+    srv = ngx_http_get_module_srv_conf (r, ngx_http_pta_module);
+    loc = ngx_http_get_module_loc_conf (r, ngx_http_pta_module);
+
+    ngx_memzero (&pta, sizeof (pta));
+    pta.auth_type = NGX_IIJPTA_AUTH_BODY;
+    pta.strict = ngx_http_pta_overloaded (r);
+    pta.timed = ngx_http_pta_timing_sampled (r);
+
+    ret = ngx_http_pta_verify (r, srv, loc, &pta);
+    if (ret)
+      {
+          ngx_http_pta_fail (r, loc, ret);
+          ngx_http_pta_count_outcome (r, loc, ret, pta.auth_type, pta.reason);
+          ngx_http_pta_timing_save (r, &pta);
+          return ret;
+      }
+
+    ret = ngx_http_pta_accept (r, srv, loc, &pta);
+    ngx_http_pta_count_outcome (r, loc, ret, pta.auth_type, 0);
+    ngx_http_pta_timing_save (r, &pta);
+
+    return (ret == NGX_DECLINED) ? NGX_OK : ret;
+}
+
+static ngx_int_t
+ngx_http_pta_request_body_filter (ngx_http_request_t * r, ngx_chain_t * in)
+{
+    ngx_chain_t *cl;
+    ngx_http_pta_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx (r, ngx_http_pta_module);
+    if (ctx == NULL || !ctx->body_reading || ctx->verified || ctx->status)
+      {
+          return ngx_http_next_request_body_filter (r, in);
+      }
+
+    for (cl = in; cl; cl = cl->next)
+      {
+          if (!ngx_buf_in_memory (cl->buf))
+            {
+                continue;
+            }
+
+          if (ngx_http_pta_body_scan (ctx, cl->buf->pos, cl->buf->last)
+              != NGX_OK)
+            {
+                ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                               "pta token is invalid #8");
+                ngx_http_pta_count_outcome (r,
+                                            ngx_http_get_module_loc_conf
+                                            (r, ngx_http_pta_module),
+                                            NGX_HTTP_BAD_REQUEST,
+                                            NGX_IIJPTA_AUTH_BODY, 8);
+                ctx->status = NGX_HTTP_BAD_REQUEST;
+                return ctx->status;
+            }
+
+          // verified as soon as the value ends, before the rest is read
+          if (ctx->body_state == NGX_HTTP_PTA_BODY_FOUND)
+            {
+                ctx->status = ngx_http_pta_body_verify (r);
+                if (ctx->status)
+                  {
+                      return ctx->status;
+                  }
+                break;
+            }
+      }
+
+    return ngx_http_next_request_body_filter (r, in);
+}
+
+static void
+ngx_http_pta_body_handler (ngx_http_request_t * r)
+{
+    ngx_http_pta_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx (r, ngx_http_pta_module);
+
+    if (!ctx->verified && ctx->status == 0)
+      {
+          // the token runs to the end of the body, or there's none
+          if (ctx->body_state == NGX_HTTP_PTA_BODY_VALUE)
+            {
+                ctx->body_state = NGX_HTTP_PTA_BODY_FOUND;
+            }
+          ctx->status = ngx_http_pta_body_verify (r);
+      }
+
+    ctx->body_done = 1;
+
+    if (ctx->body_waiting)
+      {
+          ctx->body_waiting = 0;
+          r->write_event_handler = ngx_http_core_run_phases;
+          ngx_http_core_run_phases (r);
+      }
+}
+
+static ngx_int_t
+ngx_http_pta_read_body (ngx_http_request_t * r)
+{
+    ngx_int_t ret;
+    ngx_http_pta_ctx_t *ctx;
+    ngx_table_elt_t *type;
+
+    type = r->headers_in.content_type;
+    if (r->method != NGX_HTTP_POST || type == NULL
+        || type->value.len < sizeof ("application/x-www-form-urlencoded") - 1
+        || ngx_strncasecmp (type->value.data,
+                            (u_char *) "application/x-www-form-urlencoded",
+                            sizeof ("application/x-www-form-urlencoded") - 1)
+        != 0)
+      {
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "pta token is invalid #7");
+          ngx_http_pta_count_outcome (r,
+                                      ngx_http_get_module_loc_conf
+                                      (r, ngx_http_pta_module),
+                                      NGX_HTTP_BAD_REQUEST,
+                                      NGX_IIJPTA_AUTH_BODY, 7);
+          return NGX_HTTP_BAD_REQUEST;
+      }
+
+    ctx = ngx_pcalloc (r->pool, sizeof (ngx_http_pta_ctx_t));
+    if (ctx == NULL)
+      {
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    ctx->body_token = ngx_pnalloc (r->pool, NGX_HTTP_PTA_BODY_TOKEN_MAX);
+    if (ctx->body_token == NULL)
+      {
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    ctx->body_reading = 1;
+    ngx_http_set_ctx (r, ctx, ngx_http_pta_module);
+
+    ret = ngx_http_read_client_request_body (r, ngx_http_pta_body_handler);
+    if (ret == NGX_ERROR || ret >= NGX_HTTP_SPECIAL_RESPONSE)
+      {
+          return ret;
+      }
+
+    // drop the reference taken for the body now, so that it's released
+    // whichever way the request ends, as the mirror module does
+    ngx_http_finalize_request (r, NGX_DONE);
+
+    if (ctx->body_done)
+      {
+          return ctx->verified ? NGX_DECLINED : ctx->status;
+      }
+
+    ctx->body_waiting = 1;
+
+    return NGX_DONE;
+}
+
+static ngx_int_t
+ngx_http_pta_handler (ngx_http_request_t * r)
+{
+    ngx_int_t ret;
+    ngx_http_pta_srv_conf_t *srv;
+    ngx_http_pta_loc_conf_t *loc;
+    ngx_http_pta_info_t pta;
+    ngx_http_pta_ctx_t *ctx;
+    time_t deadline;
+
+    if ((srv = ngx_http_get_module_srv_conf (r, ngx_http_pta_module)) == NULL)
+      {
+          return NGX_DECLINED;
+      }
+
+    if ((loc = ngx_http_get_module_loc_conf (r, ngx_http_pta_module)) == NULL)
+      {
+          return NGX_DECLINED;
+      }
+
+    if (!loc->pta_onoff)
+      {
+          return NGX_DECLINED;
+      }
+
+    if (r->internal)
+      {
+          return NGX_DECLINED;
+      }
+
+    // verified before the uri was stripped of its token, or the token is
+    // being read from the request body
+    ctx = ngx_http_get_module_ctx (r, ngx_http_pta_module);
+    if (ctx != NULL)
+      {
+          if (ctx->verified)
+            {
+                return NGX_DECLINED;
+            }
+          return ctx->body_done ? ctx->status : NGX_DONE;
+      }
+
+    ngx_memzero (&pta, sizeof (pta));
+
+    // passed as they are, apart from the token
+    if (srv->trusted && ngx_http_pta_is_trusted (r, srv))
+      {
+          ngx_log_error (NGX_LOG_DEBUG, r->connection->log, 0,
+                         "pta client is trusted");
+          if (loc->pta_auth_method & NGX_IIJPTA_AUTH_PATH)
+            {
+                (void) ngx_http_pta_parse_path (r, loc, &pta);
+            }
+          return ngx_http_pta_pass (r, &pta, 0);
+      }
+
+    if (loc->accept_assertion
+        && ngx_http_pta_check_assertion (r, srv, &deadline) == NGX_OK)
+      {
+          ngx_log_error (NGX_LOG_DEBUG, r->connection->log, 0,
+                         "successful by assertion");
+          if (loc->pta_auth_method & NGX_IIJPTA_AUTH_PATH)
+            {
+                (void) ngx_http_pta_parse_path (r, loc, &pta);
+            }
+          return ngx_http_pta_pass (r, &pta, deadline);
+      }
+
+    if (loc->session_ticket
+        && ngx_http_pta_check_ticket (r, srv, &deadline) == NGX_OK)
+      {
+          ngx_log_error (NGX_LOG_DEBUG, r->connection->log, 0,
+                         "successful by session ticket");
+          return ngx_http_pta_pass (r, &pta, deadline);
+      }
+
+#if (NGX_PTR_SIZE == 8)
+    if (loc->fail_threshold && ngx_http_pta_fail_boxed (r, loc))
+      {
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "pta client is in the penalty box");
+          ngx_http_pta_count_outcome (r, loc, 403, 0,
+                                      NGX_HTTP_PTA_REASON_PENALTY);
+          return 403;
+      }
+#endif
+
+    pta.strict = ngx_http_pta_overloaded (r);
+    pta.timed = ngx_http_pta_timing_sampled (r);
+
+    ngx_http_pta_init_auth_type (r, loc, &pta);
+
+    ret = ngx_http_pta_verify (r, srv, loc, &pta);
+    if (ret == NGX_HTTP_PTA_READ_BODY)
+      {
+          return ngx_http_pta_read_body (r);
+      }
+    if (ret)
+      {
+          ngx_http_pta_fail (r, loc, ret);
+          ngx_http_pta_count_outcome (r, loc, ret, pta.auth_type, pta.reason);
+          ngx_http_pta_timing_save (r, &pta);
+          return ret;
+      }
+
+    ret = ngx_http_pta_accept (r, srv, loc, &pta);
+    ngx_http_pta_count_outcome (r, loc, ret, pta.auth_type, 0);
+    ngx_http_pta_timing_save (r, &pta);
+
+    return ret;
+}
+
+static ngx_str_t ngx_http_pta_admin_ops[] = {
+    ngx_string ("revoke-prefix"),
+    ngx_string ("unrevoke-prefix"),
+    ngx_string ("revoke"),
+    ngx_string ("unrevoke"),
+    ngx_null_string
+};
+
+#define NGX_HTTP_PTA_ADMIN_REVOKE_PREFIX    0
+#define NGX_HTTP_PTA_ADMIN_UNREVOKE_PREFIX  1
+#define NGX_HTTP_PTA_ADMIN_REVOKE           2
+#define NGX_HTTP_PTA_ADMIN_UNREVOKE         3
+
+static ngx_int_t
+ngx_http_pta_admin_send (ngx_http_request_t * r, ngx_uint_t status,
+                         u_char * data, size_t len)
+{
+    ngx_int_t rc;
+    ngx_buf_t *b;
+    ngx_chain_t out;
+
+    r->headers_out.status = status;
+    r->headers_out.content_length_n = len;
+    ngx_str_set (&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header (r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+      {
+          return rc;
+      }
+
+    b = ngx_calloc_buf (r->pool);
+    if (b == NULL)
+      {
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    b->pos = data;
+    b->last = data + len;
+    b->memory = (len != 0);
+    b->last_buf = (r == r->main);
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter (r, &out);
+}
+
+// "<op> <argument>", returns the index of the op in ngx_http_pta_admin_ops
+static ngx_int_t
+ngx_http_pta_admin_parse (u_char * p, u_char * last, ngx_str_t * arg)
+{
+    u_char *sp, c;
+    ngx_uint_t i, j;
+
+    sp = memchr (p, ' ', last - p);
+    if (sp == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    arg->data = sp + 1;
+    arg->len = last - arg->data;
+
+    for (i = 0; ngx_http_pta_admin_ops[i].len; i++)
+      {
+          if ((size_t) (sp - p) == ngx_http_pta_admin_ops[i].len
+              && ngx_strncmp (p, ngx_http_pta_admin_ops[i].data, sp - p) == 0)
+            {
+                break;
+            }
+      }
+
+    switch (i)
+      {
+      case NGX_HTTP_PTA_ADMIN_REVOKE_PREFIX:
+      case NGX_HTTP_PTA_ADMIN_UNREVOKE_PREFIX:
+          if (arg->len == 0 || arg->len > NGX_HTTP_PTA_PREFIX_MAX
+              || arg->data[0] != '/')
+            {
+                return NGX_ERROR;
+            }
+          return i;
+
+      case NGX_HTTP_PTA_ADMIN_REVOKE:
+      case NGX_HTTP_PTA_ADMIN_UNREVOKE:
+          if (arg->len != 2 * NGX_HTTP_PTA_FINGERPRINT_LEN)
+            {
+                return NGX_ERROR;
+            }
+          for (j = 0; j < arg->len; j++)
+            {
+                c = arg->data[j];
+                if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')
+                      || (c >= 'A' && c <= 'F')))
+                  {
+                      return NGX_ERROR;
+                  }
+            }
+          return i;
+
+      default:
+          return NGX_ERROR;
+      }
+}
+
+static ngx_int_t
+ngx_http_pta_admin_apply (ngx_http_request_t * r,
+                          ngx_http_pta_zone_ctx_t * zctx)
+{
+    u_char *body, *p, *last, *eol, *err;
+    u_char fp[NGX_HTTP_PTA_FINGERPRINT_LEN];
+    size_t len;
+    ngx_uint_t pass, line, done;
+    ngx_int_t op, rc;
+    ngx_str_t arg;
+    ngx_chain_t *cl;
+
+    if (r->request_body == NULL || r->request_body->temp_file)
+      {
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "pta admin request is larger than "
+                         "client_body_buffer_size");
+          return NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+      }
+
+    len = 0;
+    for (cl = r->request_body->bufs; cl; cl = cl->next)
+      {
+          len += cl->buf->last - cl->buf->pos;
+      }
+
+    body = ngx_pnalloc (r->pool, len + NGX_INT_T_LEN + sizeof ("OK \n"));
+    if (body == NULL)
+      {
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    last = body;
+    for (cl = r->request_body->bufs; cl; cl = cl->next)
+      {
+          last = ngx_cpymem (last, cl->buf->pos, cl->buf->last - cl->buf->pos);
+      }
+
+    // every line is checked before any of them is applied
+    ngx_shmtx_lock (&zctx->shpool->mutex);
+
+    done = 0;
+
+    for (pass = 0; pass < 2; pass++)
+      {
+          line = 0;
+
+          for (p = body; p < last; p = eol + 1)
+            {
+                line++;
+
+                eol = memchr (p, LF, last - p);
+                if (eol == NULL)
+                  {
+                      eol = last;
+                  }
+
+                len = eol - p;
+                if (len && p[len - 1] == CR)
+                  {
+                      len--;
+                  }
+                if (len == 0)
+                  {
+                      continue;
+                  }
+
+                op = ngx_http_pta_admin_parse (p, p + len, &arg);
+                if (op == NGX_ERROR)
+                  {
+                      ngx_shmtx_unlock (&zctx->shpool->mutex);
+
+                      err = ngx_pnalloc (r->pool, NGX_INT_T_LEN
+                                         + sizeof ("invalid line \n"));
+                      if (err == NULL)
+                        {
+                            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                        }
+
+                      len = ngx_sprintf (err, "invalid line %ui\n", line)
+                          - err;
+
+                      return ngx_http_pta_admin_send (r, NGX_HTTP_BAD_REQUEST,
+                                                      err, len);
+                  }
+
+                if (pass == 0)
+                  {
+                      continue;
+                  }
+
+                switch (op)
+                  {
+                  case NGX_HTTP_PTA_ADMIN_REVOKE_PREFIX:
+                  case NGX_HTTP_PTA_ADMIN_UNREVOKE_PREFIX:
+                      rc = ngx_http_pta_prefix_update (zctx, arg.data,
+                                                       arg.len,
+                                                       op ==
+                                                       NGX_HTTP_PTA_ADMIN_REVOKE_PREFIX);
+                      break;
+
+                  default:
+                      ngx_http_pta_hex2bin (arg.data, arg.len, fp);
+                      rc = ngx_http_pta_fingerprint_update (zctx,
+                                                            ngx_http_pta_fingerprint
+                                                            (fp),
+                                                            op ==
+                                                            NGX_HTTP_PTA_ADMIN_REVOKE);
+                      break;
+                  }
+
+                if (rc != NGX_OK)
+                  {
+                      ngx_shmtx_unlock (&zctx->shpool->mutex);
+                      ngx_log_error (NGX_LOG_ALERT, r->connection->log, 0,
+                                     "no memory%s, %ui lines applied",
+                                     zctx->shpool->log_ctx, done);
+                      return NGX_HTTP_INSUFFICIENT_STORAGE;
+                  }
+
+                done++;
+            }
+      }
+
+    ngx_shmtx_unlock (&zctx->shpool->mutex);
+
+    return ngx_http_pta_admin_send (r, NGX_HTTP_OK, body,
+                                    ngx_sprintf (body, "OK %ui\n", done)
+                                    - body);
+}
+
+static void
+ngx_http_pta_admin_body_handler (ngx_http_request_t * r)
+{
+    ngx_http_pta_main_conf_t *pmcf;
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+
+    ngx_http_finalize_request (r,
+                               ngx_http_pta_admin_apply (r,
+                                                         pmcf->shm_zone->data));
+}
+
+static ngx_int_t
+ngx_http_pta_admin_handler (ngx_http_request_t * r)
+{
+    ngx_int_t rc;
+    u_char *list, *last, *path;
+    ngx_http_pta_zone_ctx_t *zctx;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+    if (pmcf->shm_zone == NULL)
+      {
+          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
+                         "pta_admin requires pta_zone");
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    if (r->method == NGX_HTTP_POST)
+      {
+          r->request_body_in_single_buf = 1;
+
+          rc = ngx_http_read_client_request_body (r,
+                                                  ngx_http_pta_admin_body_handler);
+          if (rc >= NGX_HTTP_SPECIAL_RESPONSE)
+            {
+                return rc;
+            }
+
+          return NGX_DONE;
+      }
+
+    if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
+      {
+          return NGX_HTTP_NOT_ALLOWED;
+      }
+
+    rc = ngx_http_discard_request_body (r);
+    if (rc != NGX_OK)
+      {
+          return rc;
+      }
+
+    zctx = pmcf->shm_zone->data;
+
+    path = ngx_pnalloc (r->pool, NGX_HTTP_PTA_PREFIX_MAX);
+    if (path == NULL)
+      {
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    ngx_shmtx_lock (&zctx->shpool->mutex);
+
+    list = ngx_pnalloc (r->pool, zctx->sh->prefixes_size + 1);
+    if (list == NULL)
+      {
+          ngx_shmtx_unlock (&zctx->shpool->mutex);
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    last = ngx_http_pta_prefix_list (&zctx->sh->prefixes, path, 0, list,
+                                     list + zctx->sh->prefixes_size);
+
+    ngx_shmtx_unlock (&zctx->shpool->mutex);
+
+    if (last == NULL)
+      {
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    return ngx_http_pta_admin_send (r, NGX_HTTP_OK, list, last - list);
+}
+
+// the next directive of a Cache-Control value from p, with no value when
+// it has no `=', or NULL after the last one
+static u_char *
+ngx_http_pta_cache_control_next (u_char * p, u_char * last, ngx_str_t * name,
+                                 ngx_str_t * value)
+{
+    while (p < last && (*p == ' ' || *p == '\t' || *p == ','))
+      {
+          p++;
+      }
+
+    if (p == last)
+      {
+          return NULL;
+      }
+
+    name->data = p;
+    while (p < last && *p != '=' && *p != ',' && *p != ' ' && *p != '\t')
+      {
+          p++;
+      }
+    name->len = p - name->data;
+
+    value->len = 0;
+    value->data = NULL;
+
+    if (p < last && *p == '=')
+      {
+          value->data = ++p;
+
+          if (p < last && *p == '"')
+            {
+                // a quoted string may have commas in it
+                for (p++; p < last && *p != '"'; p++)
+                  {
+                      if (*p == '\\' && p + 1 < last)
+                        {
+                            p++;
+                        }
+                  }
+                if (p < last)
+                  {
+                      p++;
+                  }
+            }
+          else
+            {
+                while (p < last && *p != ',' && *p != ' ' && *p != '\t')
+                  {
+                      p++;
+                  }
+            }
+
+          value->len = p - value->data;
+      }
+
+    while (p < last && *p != ',')
+      {
+          p++;
+      }
+
+    return p;
+}
+
+#define ngx_http_pta_cache_control_is(name, s)                              \
+    ((name).len == sizeof (s) - 1                                           \
+     && ngx_strncasecmp ((name).data, (u_char *) s, sizeof (s) - 1) == 0)
+
+static ngx_int_t
+ngx_http_pta_cache_control_max_age (ngx_http_request_t * r, time_t * max_age)
+{
+    u_char *p, *last;
+    ngx_int_t n;
+    ngx_str_t name, value;
+    ngx_table_elt_t *cc;
+
+#if nginx_version < 1023000
+    ngx_uint_t i;
+    ngx_table_elt_t **ccp;
+
+    ccp = r->headers_out.cache_control.elts;
+
+    for (i = 0; i < r->headers_out.cache_control.nelts; i++)
+      {
+          cc = ccp[i];
+#else
+    for (cc = r->headers_out.cache_control; cc != NULL; cc = cc->next)
+      {
+#endif
+          if (cc->hash == 0)
+            {
+                continue;
+            }
+
+          p = cc->value.data;
+          last = p + cc->value.len;
+
+          while ((p = ngx_http_pta_cache_control_next (p, last, &name,
+                                                        &value)) != NULL)
+            {
+                // leave responses the upstream marked as uncacheable alone
+                if (ngx_http_pta_cache_control_is (name, "no-cache")
+                    || ngx_http_pta_cache_control_is (name, "no-store"))
+                  {
+                      return NGX_DECLINED;
+                  }
+
+                if (!ngx_http_pta_cache_control_is (name, "max-age")
+                    || value.data == NULL)
+                  {
+                      continue;
+                  }
+
+                n = ngx_atoi (value.data, value.len);
+                if (n != NGX_ERROR && n < *max_age)
+                  {
+                      *max_age = n;
+                  }
+            }
+      }
+
+    return NGX_OK;
+}
+
+// lowers max-age and s-maxage of a Cache-Control value to max_age, the
+// other directives are kept as they are
+static ngx_int_t
+ngx_http_pta_cache_control_lower (ngx_http_request_t * r,
+                                  ngx_table_elt_t * cc, time_t max_age,
+                                  ngx_uint_t * found)
+{
+    u_char *p, *last, *start, *buf, *b;
+    ngx_int_t n;
+    ngx_uint_t count;
+    ngx_str_t name, value;
+
+    last = cc->value.data + cc->value.len;
+
+    count = 0;
+    for (p = cc->value.data;
+         (p = ngx_http_pta_cache_control_next (p, last, &name, &value))
+         != NULL;)
+      {
+          if (ngx_http_pta_cache_control_is (name, "max-age")
+              || ngx_http_pta_cache_control_is (name, "s-maxage"))
+            {
+                count++;
+            }
+      }
+
+    if (count == 0)
+      {
+          return NGX_OK;
+      }
+
+    buf = ngx_pnalloc (r->pool, cc->value.len + count * (1 + NGX_TIME_T_LEN));
+    if (buf == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    b = buf;
+    start = cc->value.data;
+
+    for (p = cc->value.data;
+         (p = ngx_http_pta_cache_control_next (p, last, &name, &value))
+         != NULL;)
+      {
+          if (ngx_http_pta_cache_control_is (name, "max-age"))
+            {
+                *found = 1;
+            }
+          else if (!ngx_http_pta_cache_control_is (name, "s-maxage"))
+            {
+                continue;
+            }
+
+          if (value.data == NULL)
+            {
+                b = ngx_cpymem (b, start, name.data + name.len - start);
+                b = ngx_sprintf (b, "=%T", max_age);
+                start = name.data + name.len;
+                continue;
+            }
+
+          n = ngx_atoi (value.data, value.len);
+          if (n == NGX_ERROR || n > max_age)
+            {
+                b = ngx_cpymem (b, start, value.data - start);
+                b = ngx_sprintf (b, "%T", max_age);
+                start = value.data + value.len;
+            }
+      }
+
+    b = ngx_cpymem (b, start, last - start);
+
+    cc->value.data = buf;
+    cc->value.len = b - buf;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_pta_header_filter (ngx_http_request_t * r)
+{
+    u_char *p;
+    time_t now, max_age;
+    size_t len;
+    ngx_uint_t found;
+    ngx_table_elt_t *e, *cc, *first;
+    ngx_http_pta_ctx_t *ctx;
+    ngx_http_pta_loc_conf_t *loc;
+#if nginx_version < 1023000
+    ngx_uint_t i;
+    ngx_table_elt_t **ccp;
+#endif
+
+    if (r != r->main)
+      {
+          return ngx_http_next_header_filter (r);
+      }
+
+    // no deadline is known for a trusted client
+    ctx = ngx_http_get_module_ctx (r, ngx_http_pta_module);
+    if (ctx == NULL || !ctx->verified || ctx->deadline == 0)
+      {
+          return ngx_http_next_header_filter (r);
+      }
+
+    loc = ngx_http_get_module_loc_conf (r, ngx_http_pta_module);
+    if (!loc->cache_control)
+      {
+          return ngx_http_next_header_filter (r);
+      }
+
+    if (r->headers_out.status != NGX_HTTP_OK
+        && r->headers_out.status != NGX_HTTP_NON_AUTHORITATIVE_INFORMATION
+        && r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT
+        && r->headers_out.status != NGX_HTTP_NOT_MODIFIED)
+      {
+          return ngx_http_next_header_filter (r);
+      }
+
+    now = ngx_time ();
+    max_age = (ctx->deadline > now) ? ctx->deadline - now : 0;
+
+    if (loc->cache_control_max && loc->cache_control_max < max_age)
+      {
+          max_age = loc->cache_control_max;
+      }
+
+    if (ngx_http_pta_cache_control_max_age (r, &max_age) == NGX_DECLINED)
+      {
+          return ngx_http_next_header_filter (r);
+      }
+
+    e = r->headers_out.expires;
+
+    if (e == NULL)
+      {
+          e = ngx_list_push (&r->headers_out.headers);
+          if (e == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+          r->headers_out.expires = e;
+#if nginx_version >= 1023000
+          e->next = NULL;
+#endif
+          e->hash = 1;
+          ngx_str_set (&e->key, "Expires");
+      }
+
+    len = sizeof ("Mon, 28 Sep 1970 06:00:00 GMT");
+    e->value.len = len - 1;
+    e->value.data = ngx_pnalloc (r->pool, len);
+    if (e->value.data == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    ngx_http_time (e->value.data, now + max_age);
+
+    first = NULL;
+    found = 0;
+
+#if nginx_version < 1023000
+    ccp = r->headers_out.cache_control.elts;
+
+    for (i = 0; i < r->headers_out.cache_control.nelts; i++)
+      {
+          cc = ccp[i];
+#else
+    for (cc = r->headers_out.cache_control; cc != NULL; cc = cc->next)
+      {
+#endif
+          if (cc->hash == 0)
+            {
+                continue;
+            }
+
+          if (first == NULL)
+            {
+                first = cc;
+            }
+
+          if (ngx_http_pta_cache_control_lower (r, cc, max_age, &found)
+              != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+      }
+
+    if (first == NULL)
+      {
+          cc = ngx_list_push (&r->headers_out.headers);
+          if (cc == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+          cc->hash = 1;
+          ngx_str_set (&cc->key, "Cache-Control");
+          ngx_str_null (&cc->value);
+
+#if nginx_version < 1023000
+          if (ccp == NULL
+              && ngx_array_init (&r->headers_out.cache_control, r->pool,
+                                 1, sizeof (ngx_table_elt_t *)) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+          ccp = ngx_array_push (&r->headers_out.cache_control);
+          if (ccp == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+          *ccp = cc;
+#else
+          cc->next = r->headers_out.cache_control;
+          r->headers_out.cache_control = cc;
+#endif
+
+          first = cc;
+      }
+
+    // without a max-age of the upstream, one is added to the first header
+    if (!found)
+      {
+          p = ngx_pnalloc (r->pool, first->value.len
+                           + sizeof (", max-age=") - 1 + NGX_TIME_T_LEN);
+          if (p == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+          len = first->value.len;
+          ngx_memcpy (p, first->value.data, len);
+          if (len)
+            {
+                len = ngx_cpymem (p + len, ", ", 2) - p;
+            }
+
+          first->value.len = ngx_sprintf (p + len, "max-age=%T", max_age) - p;
+          first->value.data = p;
+      }
+
+    ngx_log_debug1 (NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "pta cache control: max-age=%T", max_age);
+
+    return ngx_http_next_header_filter (r);
+}
+
+typedef struct
+{
+    ngx_str_t name;
+    char *help;
+    char *label;
+    char **values;              /* NULL for a single counter */
+    ngx_uint_t first;
+} ngx_http_pta_metric_t;
+
+static char *ngx_http_pta_stat_outcomes[] = {
+    "pass", "400", "403", "410", "other", NULL
+};
+
+static char *ngx_http_pta_stat_reasons[] = {
+    "1", "2", "3", "4", "5", "6", "7", "8", "9",
+    "decrypt", "revoked", "expired", "url", "penalty", NULL
+};
+
+static char *ngx_http_pta_stat_keys[] = {
+    "1st", "2nd", NULL
+};
+
+static char *ngx_http_pta_stat_method_names[] = {
+    "qs", "cookie", "header", "path", "body", NULL
+};
+
+static ngx_uint_t ngx_http_pta_stat_methods[] = {
+    NGX_IIJPTA_AUTH_QS,
+    NGX_IIJPTA_AUTH_COOKIE,
+    NGX_IIJPTA_AUTH_HEADER,
+    NGX_IIJPTA_AUTH_PATH,
+    NGX_IIJPTA_AUTH_BODY,
+    0
+};
+
+static ngx_http_pta_metric_t ngx_http_pta_metrics[] = {
+    {ngx_string ("pta_verifications_total"),
+     "Tokens verified, by outcome.",
+     "outcome", ngx_http_pta_stat_outcomes, NGX_HTTP_PTA_STAT_OUTCOME},
+    {ngx_string ("pta_failures_total"),
+     "Failed verifications, by reason.",
+     "reason", ngx_http_pta_stat_reasons, NGX_HTTP_PTA_STAT_REASON},
+    {ngx_string ("pta_key_hits_total"),
+     "Tokens decrypted, by key.",
+     "key", ngx_http_pta_stat_keys, NGX_HTTP_PTA_STAT_KEY},
+    {ngx_string ("pta_methods_total"),
+     "Verifications, by the method the token was taken from.",
+     "method", ngx_http_pta_stat_method_names, NGX_HTTP_PTA_STAT_METHOD},
+    {ngx_string ("pta_cookie_fallbacks_total"),
+     "Fallbacks to the cookie when the token was missing.",
+     NULL, NULL, NGX_HTTP_PTA_STAT_FALLBACK},
+    {ngx_string ("pta_cookie_candidates_total"),
+     "Cookies tried as tokens.",
+     NULL, NULL, NGX_HTTP_PTA_STAT_CANDIDATE},
+    {ngx_null_string, NULL, NULL, NULL, 0}
+};
+
+static void
+ngx_http_pta_count (ngx_http_request_t * r, ngx_http_pta_loc_conf_t * loc,
+                    ngx_uint_t n)
+{
+    ngx_atomic_t *row;
+    ngx_http_pta_stat_ctx_t *sctx;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+    if (pmcf->stat_zone == NULL || loc->stat_index == NGX_CONF_UNSET_UINT)
+      {
+          return;
+      }
+
+    sctx = pmcf->stat_zone->data;
+
+    // still atomic, since rows are shared when worker_processes comes
+    // after the http block
+    row = sctx->counters + (ngx_worker % sctx->rows) * sctx->row_size
+        + loc->stat_index * NGX_HTTP_PTA_STAT_N;
+
+    (void) ngx_atomic_fetch_add (&row[n], 1);
+}
+
+static void
+ngx_http_pta_count_outcome (ngx_http_request_t * r,
+                            ngx_http_pta_loc_conf_t * loc, ngx_int_t status,
+                            ngx_uint_t auth_type, ngx_uint_t reason)
+{
+    ngx_uint_t i;
+
+    switch (status)
+      {
+      case NGX_OK:
+      case NGX_DECLINED:
+          i = 0;
+          break;
+      case NGX_HTTP_BAD_REQUEST:
+          i = 1;
+          break;
+      case 403:
+          i = 2;
+          break;
+      case 410:
+          i = 3;
+          break;
+      default:
+          i = 4;
+      }
+
+    ngx_http_pta_count (r, loc, NGX_HTTP_PTA_STAT_OUTCOME + i);
+
+    if (i != 0 && reason)
+      {
+          ngx_http_pta_count (r, loc, NGX_HTTP_PTA_STAT_REASON + reason - 1);
+      }
+
+    for (i = 0; ngx_http_pta_stat_methods[i]; i++)
+      {
+          if (auth_type == ngx_http_pta_stat_methods[i])
+            {
+                ngx_http_pta_count (r, loc, NGX_HTTP_PTA_STAT_METHOD + i);
+                break;
+            }
+      }
+}
+
+static char *ngx_http_pta_timing_stages[] = {
+    "build_info", "hex", "decrypt", "crc", "match", "delete_arg", NULL
+};
+
+static ngx_uint_t ngx_http_pta_timing_tick;
+
+// one in pta_timing_sample verifications of the worker
+static uint8_t
+ngx_http_pta_timing_sampled (ngx_http_request_t * r)
+{
+    ngx_http_pta_main_conf_t *pmcf;
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+    if (pmcf->timing_sample == 0)
+      {
+          return 0;
+      }
+
+    return ++ngx_http_pta_timing_tick % pmcf->timing_sample == 0;
+}
+
+static ngx_uint_t
+ngx_http_pta_timing_bucket (uint64_t ns)
+{
+    ngx_uint_t e;
+
+    // a bucket takes its bound too, as the le of a histogram is inclusive
+    if (ns <= (1 << NGX_HTTP_PTA_TIMING_MIN))
+      {
+          return 0;
+      }
+
+    ns--;
+
+    if (ns >> NGX_HTTP_PTA_TIMING_MAX)
+      {
+          return NGX_HTTP_PTA_TIMING_BUCKETS;
+      }
+
+    for (e = NGX_HTTP_PTA_TIMING_MIN; ns >> (e + 1); e++)
+      {
+          /* void */
+      }
+
+    // ns >> (e - 2) is 4 to 7
+    return 1 + (e - NGX_HTTP_PTA_TIMING_MIN) * 4 + ((ns >> (e - 2)) & 3);
+}
+
+// the upper bound of a bucket in nsec, included in the bucket
+static uint64_t
+ngx_http_pta_timing_bound (ngx_uint_t b)
+{
+    ngx_uint_t e;
+
+    if (b == 0)
+      {
+          return 1 << NGX_HTTP_PTA_TIMING_MIN;
+      }
+
+    e = NGX_HTTP_PTA_TIMING_MIN + (b - 1) / 4;
+
+    return (uint64_t) (5 + (b - 1) % 4) << (e - 2);
+}
+
+static void
+ngx_http_pta_timing_add (ngx_http_request_t * r, ngx_http_pta_info_t * pta,
+                         ngx_uint_t stage, uint64_t start)
+{
+    uint64_t ns;
+    ngx_atomic_t *h;
+    ngx_http_pta_stat_ctx_t *sctx;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    ns = ngx_http_pta_clock () - start;
+    pta->timing[stage] += ns;
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+    if (pmcf->stat_zone == NULL)
+      {
+          return;
+      }
+
+    sctx = pmcf->stat_zone->data;
+    h = sctx->counters + (ngx_worker % sctx->rows) * sctx->row_size
+        + sctx->timing + stage * NGX_HTTP_PTA_TIMING_SIZE;
+
+    (void) ngx_atomic_fetch_add (&h[ngx_http_pta_timing_bucket (ns)], 1);
+    (void) ngx_atomic_fetch_add (&h[NGX_HTTP_PTA_TIMING_COUNT], 1);
+    (void) ngx_atomic_fetch_add (&h[NGX_HTTP_PTA_TIMING_SUM], ns);
+}
+
+// kept for $pta_timing
+static void
+ngx_http_pta_timing_save (ngx_http_request_t * r, ngx_http_pta_info_t * pta)
+{
+    ngx_http_pta_ctx_t *ctx;
+
+    if (!pta->timed)
+      {
+          return;
+      }
+
+    ctx = ngx_http_get_module_ctx (r, ngx_http_pta_module);
+    if (ctx == NULL)
+      {
+          ctx = ngx_pcalloc (r->pool, sizeof (ngx_http_pta_ctx_t));
+          if (ctx == NULL)
+            {
+                return;
+            }
+          ngx_http_set_ctx (r, ctx, ngx_http_pta_module);
+      }
+
+    ngx_memcpy (ctx->timing, pta->timing, sizeof (pta->timing));
+    ctx->timed = 1;
+}
+
+static ngx_int_t
+ngx_http_pta_timing_variable (ngx_http_request_t * r,
+                              ngx_http_variable_value_t * v, uintptr_t data)
+{
+    u_char *p;
+    ngx_uint_t i;
+    ngx_http_pta_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx (r, ngx_http_pta_module);
+    if (ctx == NULL || !ctx->timed)
+      {
+          v->not_found = 1;
+          return NGX_OK;
+      }
+
+    p = ngx_pnalloc (r->pool, NGX_HTTP_PTA_TIMING_N
+                     * (sizeof ("delete_arg=,") - 1 + NGX_INT64_LEN));
+    if (p == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    v->data = p;
+
+    for (i = 0; i < NGX_HTTP_PTA_TIMING_N; i++)
+      {
+          p = ngx_sprintf (p, "%s%s=%uL", i ? "," : "",
+                           ngx_http_pta_timing_stages[i], ctx->timing[i]);
+      }
+
+    v->len = p - v->data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_pta_add_variables (ngx_conf_t * cf)
+{
+    ngx_str_t name = ngx_string ("pta_timing");
+    ngx_http_variable_t *var;
+
+    var = ngx_http_add_variable (cf, &name, NGX_HTTP_VAR_NOCACHEABLE);
+    if (var == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    var->get_handler = ngx_http_pta_timing_variable;
+
+    return NGX_OK;
+}
+
+// a label value, where a regular expression may well have '\'
+static u_char *
+ngx_http_pta_stat_escape (u_char * p, ngx_str_t * s)
+{
+    ngx_uint_t i;
+
+    for (i = 0; i < s->len; i++)
+      {
+          if (s->data[i] == '\\' || s->data[i] == '"')
+            {
+                *p++ = '\\';
+            }
+          else if (s->data[i] == LF)
+            {
+                *p++ = '\\';
+                *p++ = 'n';
+                continue;
+            }
+          *p++ = s->data[i];
+      }
+
+    return p;
+}
+
+static ngx_int_t
+ngx_http_pta_status_handler (ngx_http_request_t * r)
+{
+    u_char *data, *p;
+    size_t len, names;
+    ngx_int_t rc;
+    ngx_str_t *name;
+    uint64_t ns;
+    ngx_uint_t i, j, k, n, w;
+    ngx_atomic_uint_t sum, count;
+    ngx_atomic_t *counters;
+    ngx_http_pta_metric_t *m;
+    ngx_http_pta_zone_ctx_t *zctx;
+    ngx_http_pta_stat_ctx_t *sctx;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
+      {
+          return NGX_HTTP_NOT_ALLOWED;
+      }
+
+    rc = ngx_http_discard_request_body (r);
+    if (rc != NGX_OK)
+      {
+          return rc;
+      }
+
+    pmcf = ngx_http_get_module_main_conf (r, ngx_http_pta_module);
+    sctx = pmcf->stat_zone->data;
+    counters = sctx->counters;
+
+    name = pmcf->stat_locations.elts;
+    names = 0;
+    for (i = 0; i < pmcf->stat_locations.nelts; i++)
+      {
+          names += 2 * name[i].len;
+      }
+
+    len = 0;
+    for (m = ngx_http_pta_metrics; m->name.len; m++)
+      {
+          n = 1;
+          if (m->values)
+            {
+                for (n = 0; m->values[n]; n++)
+                  {
+                      /* void */
+                  }
+            }
+
+          len += sizeof ("# HELP  \n# TYPE  counter\n") - 1
+              + 2 * m->name.len + ngx_strlen (m->help)
+              + n * (pmcf->stat_locations.nelts
+                     * (m->name.len + sizeof ("{location=\"\",=\"\"} \n") - 1
+                        + (m->label ? ngx_strlen (m->label) : 0)
+                        + sizeof ("decrypt") - 1 + NGX_ATOMIC_T_LEN)
+                     + names);
+      }
+
+    len += sizeof ("# HELP pta_stage_seconds  \n# TYPE pta_stage_seconds histogram\n")
+        + sizeof (NGX_HTTP_PTA_TIMING_HELP)
+        + NGX_HTTP_PTA_TIMING_N
+        * ((NGX_HTTP_PTA_TIMING_BUCKETS + 1)
+           * (sizeof ("pta_stage_seconds_bucket{stage=\"\",le=\"0.\"} \n")
+              + sizeof ("delete_arg") + 9 + NGX_ATOMIC_T_LEN)
+           + sizeof ("pta_stage_seconds_sum{stage=\"\"} .\n")
+           + 9 + 2 * NGX_ATOMIC_T_LEN
+           + sizeof ("pta_stage_seconds_count{stage=\"\"} \n")
+           + NGX_ATOMIC_T_LEN + 2 * sizeof ("delete_arg"));
+
+    len += sizeof ("# HELP pta_overload_active Whether pta_overload is on.\n"
+                   "# TYPE pta_overload_active gauge\n"
+                   "pta_overload_active \n"
+                   "# HELP pta_overload_entered_total"
+                   " Times pta_overload was entered.\n"
+                   "# TYPE pta_overload_entered_total counter\n"
+                   "pta_overload_entered_total \n")
+        + 2 * NGX_ATOMIC_T_LEN;
+
+    data = ngx_pnalloc (r->pool, len);
+    if (data == NULL)
+      {
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+    p = data;
+
+    for (m = ngx_http_pta_metrics; m->name.len; m++)
+      {
+          p = ngx_sprintf (p, "# HELP %V %s\n# TYPE %V counter\n",
+                           &m->name, m->help, &m->name);
+
+          for (i = 0; i < pmcf->stat_locations.nelts; i++)
+            {
+                for (j = 0; j == 0 || (m->values && m->values[j]); j++)
+                  {
+                      k = i * NGX_HTTP_PTA_STAT_N + m->first + j;
+
+                      sum = 0;
+                      for (w = 0; w < sctx->rows; w++)
+                        {
+                            sum += counters[w * sctx->row_size + k];
+                        }
+
+                      p = ngx_sprintf (p, "%V{location=\"", &m->name);
+                      p = ngx_http_pta_stat_escape (p, &name[i]);
+                      if (m->values)
+                        {
+                            p = ngx_sprintf (p, "\",%s=\"%s", m->label,
+                                             m->values[j]);
+                        }
+                      p = ngx_sprintf (p, "\"} %uA\n", sum);
+                  }
+            }
+      }
+
+    p = ngx_sprintf (p, "# HELP pta_stage_seconds %s\n"
+                     "# TYPE pta_stage_seconds histogram\n",
+                     NGX_HTTP_PTA_TIMING_HELP);
+
+    for (i = 0; i < NGX_HTTP_PTA_TIMING_N; i++)
+      {
+          k = sctx->timing + i * NGX_HTTP_PTA_TIMING_SIZE;
+          sum = 0;
+
+          for (j = 0; j < NGX_HTTP_PTA_TIMING_BUCKETS; j++)
+            {
+                for (w = 0; w < sctx->rows; w++)
+                  {
+                      sum += counters[w * sctx->row_size + k + j];
+                  }
+
+                p = ngx_sprintf (p, "pta_stage_seconds_bucket{stage=\"%s\","
+                                 "le=\"0.%09uL\"} %uA\n",
+                                 ngx_http_pta_timing_stages[i],
+                                 ngx_http_pta_timing_bound (j), sum);
+            }
+
+          count = 0;
+          ns = 0;
+          for (w = 0; w < sctx->rows; w++)
+            {
+                count += counters[w * sctx->row_size + k
+                                  + NGX_HTTP_PTA_TIMING_COUNT];
+                ns += counters[w * sctx->row_size + k
+                               + NGX_HTTP_PTA_TIMING_SUM];
+            }
+
+          p = ngx_sprintf (p, "pta_stage_seconds_bucket{stage=\"%s\","
+                           "le=\"+Inf\"} %uA\n"
+                           "pta_stage_seconds_sum{stage=\"%s\"} %uL.%09uL\n"
+                           "pta_stage_seconds_count{stage=\"%s\"} %uA\n",
+                           ngx_http_pta_timing_stages[i], count,
+                           ngx_http_pta_timing_stages[i],
+                           ns / 1000000000, ns % 1000000000,
+                           ngx_http_pta_timing_stages[i], count);
+      }
+
+    if (pmcf->overload_on)
+      {
+          zctx = pmcf->shm_zone->data;
+          p = ngx_sprintf (p,
+                           "# HELP pta_overload_active"
+                           " Whether pta_overload is on.\n"
+                           "# TYPE pta_overload_active gauge\n"
+                           "pta_overload_active %uA\n"
+                           "# HELP pta_overload_entered_total"
+                           " Times pta_overload was entered.\n"
+                           "# TYPE pta_overload_entered_total counter\n"
+                           "pta_overload_entered_total %uA\n",
+                           zctx->sh->overload.active,
+                           zctx->sh->overload.entered);
+      }
+
+    return ngx_http_pta_admin_send (r, NGX_HTTP_OK, data, p - data);
+}
+
+// Locations of the same name, in different servers, share counters, and
+// so do "if" blocks with their location.
+static ngx_int_t
+ngx_http_pta_stat_location (ngx_conf_t * cf, ngx_http_pta_loc_conf_t * prev,
+                            ngx_http_pta_loc_conf_t * conf)
+{
+    ngx_str_t *name;
+    ngx_uint_t i;
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf (cf, ngx_http_core_module);
+    if (clcf->noname && prev->stat_index != NGX_CONF_UNSET_UINT)
+      {
+          conf->stat_index = prev->stat_index;
+          return NGX_OK;
+      }
+
+    pmcf = ngx_http_conf_get_module_main_conf (cf, ngx_http_pta_module);
+    name = pmcf->stat_locations.elts;
+
+    for (i = 0; i < pmcf->stat_locations.nelts; i++)
+      {
+          if (name[i].len == clcf->name.len
+              && ngx_strncmp (name[i].data, clcf->name.data,
+                              clcf->name.len) == 0)
+            {
+                conf->stat_index = i;
+                return NGX_OK;
+            }
+      }
+
+    name = ngx_array_push (&pmcf->stat_locations);
+    if (name == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    *name = clcf->name;
+    conf->stat_index = i;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_pta_stat_init_zone (ngx_shm_zone_t * shm_zone, void *data)
+{
+    ngx_http_pta_stat_ctx_t *octx = data;
+    ngx_http_pta_stat_ctx_t *ctx = shm_zone->data;
+    ngx_slab_pool_t *shpool;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (octx)
+      {
+          ctx->sh = octx->sh;
+      }
+    else if (shm_zone->shm.exists)
+      {
+          ctx->sh = shpool->data;
+      }
+    else
+      {
+          // the zone is reused only when it has the same size, and so
+          // the same capacity
+          ctx->sh = ngx_slab_calloc (shpool, NGX_CPU_CACHE_LINE
+                                     + ngx_align (ctx->size, ngx_pagesize));
+          if (ctx->sh == NULL)
+            {
+                ngx_log_error (NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                               "pta_status has too many locations");
+                return NGX_ERROR;
+            }
+
+          ctx->sh->capacity = ngx_align (ctx->size, ngx_pagesize);
+          ctx->sh->layout = ctx->layout;
+          shpool->data = ctx->sh;
+      }
+
+    if (ctx->size > ctx->sh->capacity)
+      {
+          return NGX_ERROR;
+      }
+
+    ctx->counters = (ngx_atomic_t *) ((u_char *) ctx->sh
+                                      + NGX_CPU_CACHE_LINE);
+
+    // counters survive a reload unless they are of other locations
+    if (ctx->sh->layout != ctx->layout)
+      {
+          ngx_memzero ((void *) ctx->counters, ctx->sh->capacity);
+          ctx->sh->layout = ctx->layout;
+      }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_pta_stat_init (ngx_conf_t * cf, ngx_http_pta_main_conf_t * pmcf)
+{
+    size_t size;
+    uint32_t layout;
+    ngx_str_t name, *loc;
+    ngx_uint_t i;
+    ngx_core_conf_t *ccf;
+    ngx_http_pta_stat_ctx_t *ctx;
+
+    ctx = ngx_pcalloc (cf->pool, sizeof (ngx_http_pta_stat_ctx_t));
+    if (ctx == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    // worker_processes may come after the http block, and then the
+    // workers share a row
+    ccf = (ngx_core_conf_t *) ngx_get_conf (cf->cycle->conf_ctx,
+                                            ngx_core_module);
+    ctx->rows = (ccf->worker_processes > 0) ? ccf->worker_processes : 1;
+
+    ctx->timing = pmcf->stat_locations.nelts * NGX_HTTP_PTA_STAT_N;
+    ctx->row_size = ngx_align (ctx->timing
+                               + NGX_HTTP_PTA_TIMING_N
+                               * NGX_HTTP_PTA_TIMING_SIZE,
+                               NGX_CPU_CACHE_LINE / sizeof (ngx_atomic_t));
+    ctx->size = ctx->rows * ctx->row_size * sizeof (ngx_atomic_t);
+
+    ngx_crc32_init (layout);
+    ngx_crc32_update (&layout, (u_char *) & ctx->rows, sizeof (ctx->rows));
+
+    loc = pmcf->stat_locations.elts;
+    for (i = 0; i < pmcf->stat_locations.nelts; i++)
+      {
+          ngx_crc32_update (&layout, loc[i].data, loc[i].len);
+          ngx_crc32_update (&layout, (u_char *) "", 1);
+      }
+
+    ngx_crc32_final (layout);
+    ctx->layout = layout;
+
+    ngx_str_set (&name, "pta_status");
+    size = ngx_align (ctx->size, ngx_pagesize) + NGX_HTTP_PTA_STAT_SLACK;
+
+    pmcf->stat_zone = ngx_shared_memory_add (cf, &name, size,
+                                             &ngx_http_pta_metrics);
+    if (pmcf->stat_zone == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    pmcf->stat_zone->init = ngx_http_pta_stat_init_zone;
+    pmcf->stat_zone->data = ctx;
+
+    return NGX_OK;
+}
+
+static void *
+ngx_http_pta_create_main_conf (ngx_conf_t * cf)
+{
+    ngx_http_pta_main_conf_t *conf =
+        ngx_pcalloc (cf->pool, sizeof (ngx_http_pta_main_conf_t));
+    if (conf == NULL)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    if (ngx_array_init (&conf->stat_locations, cf->pool, 4,
+                        sizeof (ngx_str_t)) != NGX_OK)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    if (ngx_array_init (&conf->revocations, cf->pool, 1,
+                        sizeof (ngx_http_pta_revocation_t *)) != NGX_OK)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    conf->timing_sample = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+static char *
+ngx_http_pta_init_main_conf (ngx_conf_t * cf, void *conf)
+{
+    ngx_http_pta_main_conf_t *pmcf = conf;
+
+    if (pmcf->overload_on && pmcf->shm_zone == NULL)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "pta_overload requires pta_zone");
+          return NGX_CONF_ERROR;
+      }
+
+    ngx_conf_init_value (pmcf->timing_sample, 0);
+    if (pmcf->timing_sample < 0)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid pta_timing_sample value");
+          return NGX_CONF_ERROR;
+      }
+
+    return NGX_CONF_OK;
+}
+
+static void *
+ngx_http_pta_create_srv_conf (ngx_conf_t * cf)
+{
+    ngx_http_pta_srv_conf_t *conf =
+        ngx_pcalloc (cf->pool, sizeof (ngx_http_pta_srv_conf_t));
+    if (conf == NULL)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    return conf;
+}
+
+static void *
+ngx_http_pta_create_loc_conf (ngx_conf_t * cf)
+{
+    ngx_http_pta_loc_conf_t *conf =
+        ngx_pcalloc (cf->pool, sizeof (ngx_http_pta_loc_conf_t));
+    if (conf == NULL)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    conf->pta_onoff = NGX_CONF_UNSET;
+    conf->cache_control = NGX_CONF_UNSET;
+    conf->cache_control_max = NGX_CONF_UNSET;
+    conf->session_ticket = NGX_CONF_UNSET;
+    conf->session_ticket_ttl = NGX_CONF_UNSET;
+    conf->renew_within = NGX_CONF_UNSET;
+    conf->renew_lifetime = NGX_CONF_UNSET;
+    conf->renew_max = NGX_CONF_UNSET;
+    conf->cookie_max_candidates = NGX_CONF_UNSET_UINT;
+    conf->cookie_max_scan = NGX_CONF_UNSET_SIZE;
+    conf->max_concurrent = NGX_CONF_UNSET_UINT;
+    conf->rate = NGX_CONF_UNSET_UINT;
+    conf->fail_threshold = NGX_CONF_UNSET_UINT;
+    conf->assertion = NGX_CONF_UNSET;
+    conf->assertion_ttl = NGX_CONF_UNSET;
+    conf->accept_assertion = NGX_CONF_UNSET;
+    conf->enforce_deadline = NGX_CONF_UNSET;
+    conf->stat_index = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+static char *
+ngx_http_pta_merge_loc_conf (ngx_conf_t * cf, void *parent, void *child)
+{
+    ngx_http_pta_loc_conf_t *prev = parent;
+    ngx_http_pta_loc_conf_t *conf = child;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    ngx_conf_merge_value (conf->pta_onoff, prev->pta_onoff, 0);
+    ngx_conf_merge_uint_value (conf->pta_auth_method, prev->pta_auth_method,
+                               0);
+    ngx_conf_merge_value (conf->cache_control, prev->cache_control, 0);
+    ngx_conf_merge_value (conf->cache_control_max, prev->cache_control_max,
+                          0);
+    ngx_conf_merge_value (conf->session_ticket, prev->session_ticket, 0);
+    ngx_conf_merge_value (conf->session_ticket_ttl, prev->session_ticket_ttl,
+                          60);
+    ngx_conf_merge_value (conf->renew_within, prev->renew_within, 0);
+    ngx_conf_merge_value (conf->renew_lifetime, prev->renew_lifetime, 3600);
+    ngx_conf_merge_value (conf->renew_max, prev->renew_max, 86400);
+    ngx_conf_merge_str_value (conf->renew_header, prev->renew_header, "");
+    ngx_conf_merge_uint_value (conf->cookie_max_candidates,
+                               prev->cookie_max_candidates, 8);
+    ngx_conf_merge_size_value (conf->cookie_max_scan, prev->cookie_max_scan,
+                               16384);
+    ngx_conf_merge_uint_value (conf->max_concurrent, prev->max_concurrent, 0);
+    ngx_conf_merge_value (conf->assertion, prev->assertion, 0);
+    ngx_conf_merge_value (conf->assertion_ttl, prev->assertion_ttl, 10);
+    ngx_conf_merge_value (conf->accept_assertion, prev->accept_assertion, 0);
+    ngx_conf_merge_value (conf->enforce_deadline, prev->enforce_deadline, 0);
+
+    if (conf->rate == NGX_CONF_UNSET_UINT)
+      {
+          conf->rate = prev->rate;
+          conf->burst = prev->burst;
+      }
+    if (conf->rate == NGX_CONF_UNSET_UINT)
+      {
+          conf->rate = 0;
+      }
+
+    pmcf = ngx_http_conf_get_module_main_conf (cf, ngx_http_pta_module);
+
+    if (conf->pta_onoff && ngx_http_pta_stat_location (cf, prev, conf)
+        != NGX_OK)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    if (conf->max_concurrent && pmcf->shm_zone == NULL)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "pta_max_concurrent requires pta_zone");
+          return NGX_CONF_ERROR;
+      }
+    if (conf->rate && pmcf->shm_zone == NULL)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "pta_rate requires pta_zone");
+          return NGX_CONF_ERROR;
+      }
+
+    // neither a ticket nor an assertion tells which token it came from, so
+    // requests passed by them can't be counted against the token
+    if ((conf->max_concurrent || conf->rate)
+        && (conf->session_ticket || conf->accept_assertion))
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "pta_max_concurrent and pta_rate can't be "
+                              "used with pta_session_ticket or "
+                              "pta_accept_assertion");
+          return NGX_CONF_ERROR;
+      }
+
+    if (conf->fail_threshold == NGX_CONF_UNSET_UINT)
+      {
+          conf->fail_threshold = prev->fail_threshold;
+          conf->fail_window = prev->fail_window;
+          conf->fail_penalty = prev->fail_penalty;
+          conf->fail_ipv4_prefix = prev->fail_ipv4_prefix;
+          conf->fail_ipv6_prefix = prev->fail_ipv6_prefix;
+      }
+    if (conf->fail_threshold == NGX_CONF_UNSET_UINT)
+      {
+          conf->fail_threshold = 0;
+      }
+    if (conf->fail_threshold && pmcf->shm_zone == NULL)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "pta_fail_threshold requires pta_zone");
+          return NGX_CONF_ERROR;
+      }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_pta_check_keyiv (ngx_conf_t * cf, ngx_str_t * arg)
+{
+    size_t idx;
+
+    if (arg->len != 32)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0, "invalid length");
+          return 1;
+      }
+
+    for (idx = 0; idx < arg->len; idx++)
+      {
+          if (!(arg->data[idx] == '0' ||
+                arg->data[idx] == '1' ||
+                arg->data[idx] == '2' ||
+                arg->data[idx] == '3' ||
+                arg->data[idx] == '4' ||
+                arg->data[idx] == '5' ||
+                arg->data[idx] == '6' ||
+                arg->data[idx] == '7' ||
+                arg->data[idx] == '8' ||
+                arg->data[idx] == '9' ||
+                arg->data[idx] == 'a' ||
+                arg->data[idx] == 'b' ||
+                arg->data[idx] == 'c' ||
+                arg->data[idx] == 'd' ||
+                arg->data[idx] == 'e' ||
+                arg->data[idx] == 'f' ||
+                arg->data[idx] == 'A' ||
+                arg->data[idx] == 'B' ||
+                arg->data[idx] == 'C' ||
+                arg->data[idx] == 'D' ||
+                arg->data[idx] == 'E' || arg->data[idx] == 'F'))
+            {
+                ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                                    "invalid character is found");
+                return 1;
+            }
+      }
+
+    return 0;
+}
+
+static char *
+ngx_http_pta_set_1st_key (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+{
+    ngx_http_pta_srv_conf_t *srvc = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (ngx_http_pta_check_keyiv (cf, &value[1]))
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    srvc->key_1st.len = value[1].len;
+    srvc->key_1st.data = ngx_pstrdup (cf->pool, &value[1]);
+    ngx_http_pta_hex2bin (value[1].data, value[1].len, srvc->key_bin[0]);
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_pta_set_1st_iv (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+{
+    ngx_http_pta_srv_conf_t *srvc = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (ngx_http_pta_check_keyiv (cf, &value[1]))
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    srvc->iv_1st.len = value[1].len;
+    srvc->iv_1st.data = ngx_pstrdup (cf->pool, &value[1]);
+    ngx_http_pta_hex2bin (value[1].data, value[1].len, srvc->iv_bin[0]);
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_pta_set_2nd_key (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+{
+    ngx_http_pta_srv_conf_t *srvc = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (ngx_http_pta_check_keyiv (cf, &value[1]))
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    srvc->key_2nd.len = value[1].len;
+    srvc->key_2nd.data = ngx_pstrdup (cf->pool, &value[1]);
+    ngx_http_pta_hex2bin (value[1].data, value[1].len, srvc->key_bin[1]);
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_pta_set_2nd_iv (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+{
+    ngx_http_pta_srv_conf_t *srvc = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    if (ngx_http_pta_check_keyiv (cf, &value[1]))
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    srvc->iv_2nd.len = value[1].len;
+    srvc->iv_2nd.data = ngx_pstrdup (cf->pool, &value[1]);
+    ngx_http_pta_hex2bin (value[1].data, value[1].len, srvc->iv_bin[1]);
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_pta_set_auth_method (ngx_conf_t * cf, ngx_command_t * cmd,
+                              void *conf)
+{
+    ngx_http_pta_loc_conf_t *locc = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_conf_bitmask_t *mask = cmd->post;
+    ngx_str_t var;
+    ngx_uint_t i, m;
+    size_t idx;
+
+    if (locc->pta_auth_method)
+      {
+          return "is duplicate";
+      }
+
+    for (i = 1; i < cf->args->nelts; i++)
+      {
+          if (ngx_strncasecmp (value[i].data, (u_char *) "header=", 7) == 0
+              && value[i].len > 7)
+            {
+                locc->auth_header.len = value[i].len - 7;
+                locc->auth_header.data = value[i].data + 7;
+                locc->pta_auth_method |= NGX_IIJPTA_AUTH_HEADER;
+                continue;
+            }
+
+          if (ngx_strncasecmp (value[i].data, (u_char *) "path=", 5) == 0
+              && value[i].len > 5)
+            {
+                locc->auth_path.len = value[i].len - 5;
+                locc->auth_path.data = value[i].data + 5;
+                if (locc->auth_path.data[0] != '/'
+                    || locc->auth_path.data[locc->auth_path.len - 1] != '/')
+                  {
+                      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                                          "path prefix \"%V\" must start "
+                                          "and end with \"/\"",
+                                          &locc->auth_path);
+                      return NGX_CONF_ERROR;
+                  }
+                locc->pta_auth_method |= NGX_IIJPTA_AUTH_PATH;
+                continue;
+            }
+
+          for (m = 0; mask[m].name.len != 0; m++)
+            {
+                if (mask[m].name.len == value[i].len
+                    && ngx_strcasecmp (mask[m].name.data, value[i].data) == 0)
+                  {
+                      break;
+                  }
+            }
+
+          if (mask[m].name.len == 0)
+            {
+                ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                                    "invalid value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+          if (locc->pta_auth_method & mask[m].mask)
+            {
+                ngx_conf_log_error (NGX_LOG_WARN, cf, 0,
+                                    "duplicate value \"%V\"", &value[i]);
+            }
+
+          locc->pta_auth_method |= mask[m].mask;
+      }
+
+    if ((locc->pta_auth_method & NGX_IIJPTA_AUTH_PATH)
+        && locc->auth_path.data == NULL)
+      {
+          ngx_str_set (&locc->auth_path, PTA_AUTH_PATH);
+      }
+
+    if (!(locc->pta_auth_method & NGX_IIJPTA_AUTH_HEADER))
+      {
+          return NGX_CONF_OK;
+      }
+
+    if (locc->auth_header.data == NULL)
+      {
+          ngx_str_set (&locc->auth_header, PTA_AUTH_HEADER);
+      }
+
+    // the header is read through $http_<name>, resolved here once
+    var.len = sizeof ("http_") - 1 + locc->auth_header.len;
+    var.data = ngx_pnalloc (cf->pool, var.len);
+    if (var.data == NULL)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    ngx_memcpy (var.data, "http_", sizeof ("http_") - 1);
+    for (idx = 0; idx < locc->auth_header.len; idx++)
+      {
+          var.data[sizeof ("http_") - 1 + idx] =
+              (locc->auth_header.data[idx] == '-') ? '_' :
+              ngx_tolower (locc->auth_header.data[idx]);
+      }
+
+    locc->auth_header_index = ngx_http_get_variable_index (cf, &var);
+    if (locc->auth_header_index == NGX_ERROR)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_pta_set_cache_control (ngx_conf_t * cf, ngx_command_t * cmd,
+                                void *conf)
+{
+    ngx_http_pta_loc_conf_t *locc = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_str_t s;
+
+    if (locc->cache_control != NGX_CONF_UNSET)
+      {
+          return "is duplicate";
+      }
+
+    if (ngx_strcasecmp (value[1].data, (u_char *) "on") == 0)
+      {
+          locc->cache_control = 1;
+      }
+    else if (ngx_strcasecmp (value[1].data, (u_char *) "off") == 0)
+      {
+          locc->cache_control = 0;
+      }
+    else
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid value \"%V\", it must be \"on\" or \"off\"",
+                              &value[1]);
+          return NGX_CONF_ERROR;
+      }
+
+    locc->cache_control_max = 0;
+
+    if (cf->args->nelts == 2)
+      {
+          return NGX_CONF_OK;
+      }
+
+    if (ngx_strncmp (value[2].data, "max=", 4) != 0)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid parameter \"%V\"", &value[2]);
+          return NGX_CONF_ERROR;
+      }
+
+    s.len = value[2].len - 4;
+    s.data = value[2].data + 4;
+
+    locc->cache_control_max = ngx_parse_time (&s, 1);
+    if (locc->cache_control_max == (time_t) NGX_ERROR
+        || locc->cache_control_max == 0)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid max value \"%V\"", &value[2]);
+          return NGX_CONF_ERROR;
+      }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_pta_set_policy (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+{
+    ngx_http_pta_srv_conf_t *srvc = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_http_pta_policy_t *policy;
+    ngx_uint_t i;
+#if (NGX_PCRE)
+    ngx_regex_compile_t rc;
+    u_char errstr[NGX_MAX_CONF_ERRSTR];
+#endif
+
+    for (i = 0; i < value[1].len; i++)
+      {
+          if (value[1].data[i] == ':')
+            {
+                return "has an invalid id";
+            }
+      }
+
+    if (srvc->policies == NULL)
+      {
+          srvc->policies = ngx_array_create (cf->pool, 4,
+                                             sizeof (ngx_http_pta_policy_t));
+          if (srvc->policies == NULL)
+            {
+                return NGX_CONF_ERROR;
+            }
+      }
+
+    policy = srvc->policies->elts;
+    for (i = 0; i < srvc->policies->nelts; i++)
+      {
+          if (policy[i].id.len == value[1].len
+              && ngx_strncmp (policy[i].id.data, value[1].data,
+                              value[1].len) == 0)
+            {
+                ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                                    "duplicate pta_policy \"%V\"", &value[1]);
+                return NGX_CONF_ERROR;
+            }
+      }
+
+    policy = ngx_array_push (srvc->policies);
+    if (policy == NULL)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    ngx_memzero (policy, sizeof (ngx_http_pta_policy_t));
+    policy->id = value[1];
+
+    if (value[2].len > 1 && value[2].data[0] == '~')
+      {
+#if (NGX_PCRE)
+          // compiled once here, with JIT when pcre_jit is on
+          ngx_memzero (&rc, sizeof (ngx_regex_compile_t));
+          rc.pattern.data = value[2].data + 1;
+          rc.pattern.len = value[2].len - 1;
+          rc.pool = cf->pool;
+          rc.err.len = NGX_MAX_CONF_ERRSTR;
+          rc.err.data = errstr;
+
+          if (ngx_regex_compile (&rc) != NGX_OK)
+            {
+                ngx_conf_log_error (NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
+                return NGX_CONF_ERROR;
+            }
+
+          policy->regex = rc.regex;
+          policy->captures = rc.captures;
+          policy->param = (rc.captures > 0);
+          return NGX_CONF_OK;
+#else
+          return "requires PCRE library";
+#endif
+      }
+
+    if (value[2].len == 0 || value[2].data[0] != '/')
+      {
+          return "must start with \"/\" or \"~\"";
+      }
+
+    policy->glob = value[2];
+    policy->param = (ngx_strlcasestrn (value[2].data,
+                                       value[2].data + value[2].len,
+                                       (u_char *) "$1", 2 - 1) != NULL);
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_pta_set_revocation_file (ngx_conf_t * cf, ngx_command_t * cmd,
+                                  void *conf)
+{
+    ngx_http_pta_srv_conf_t *srvc = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_pool_cleanup_t *cln;
+    ngx_http_pta_revocation_t **rvp;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    if (srvc->revocation != NULL)
+      {
+          return "is duplicate";
+      }
+
+    srvc->revocation = ngx_pcalloc (cf->pool,
+                                    sizeof (ngx_http_pta_revocation_t));
+    if (srvc->revocation == NULL)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    srvc->revocation->name = value[1];
+
+    if (ngx_conf_full_name (cf->cycle, &srvc->revocation->name, 1) != NGX_OK)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    cln = ngx_pool_cleanup_add (cf->pool, 0);
+    if (cln == NULL)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    cln->handler = ngx_http_pta_revocation_cleanup;
+    cln->data = srvc->revocation;
+
+    // loaded once here, and the workers inherit the list and check the
+    // file for changes on a timer
+    if (ngx_http_pta_revocation_load (srvc->revocation, cf->log) != NGX_OK)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    pmcf = ngx_http_conf_get_module_main_conf (cf, ngx_http_pta_module);
+
+    rvp = ngx_array_push (&pmcf->revocations);
+    if (rvp == NULL)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    *rvp = srvc->revocation;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_pta_init_zone (ngx_shm_zone_t * shm_zone, void *data)
+{
+    ngx_http_pta_zone_ctx_t *octx = data;
+    ngx_http_pta_zone_ctx_t *ctx = shm_zone->data;
+    size_t len;
+    ngx_uint_t n;
+    ngx_http_pta_fpset_t *set;
+
+    // revoked entries survive a reload
+    if (octx)
+      {
+          ctx->sh = octx->sh;
+          ctx->shpool = octx->shpool;
+          return NGX_OK;
+      }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists)
+      {
+          ctx->sh = ctx->shpool->data;
+          return NGX_OK;
+      }
+
+    ctx->sh = ngx_slab_calloc (ctx->shpool, sizeof (ngx_http_pta_shctx_t));
+    if (ctx->sh == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    ctx->shpool->data = ctx->sh;
+
+    // the table is kept at most three quarters full
+    set = &ctx->sh->fingerprints;
+    for (n = 16; n / 4 * 3 < ctx->fingerprints; n <<= 1)
+      {
+          /* void */
+      }
+
+    set->slots = ngx_slab_calloc (ctx->shpool, n * sizeof (uint64_t));
+    set->spare = ngx_slab_calloc (ctx->shpool, n * sizeof (uint64_t));
+    if (set->slots == NULL || set->spare == NULL)
+      {
+          ngx_log_error (NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                         "pta_zone \"%V\" is too small for %ui fingerprints",
+                         &shm_zone->shm.name, ctx->fingerprints);
+          return NGX_ERROR;
+      }
+
+    set->mask = n - 1;
+    set->limit = n / 4 * 3;
+
+    for (n = 2; n < ctx->counters; n <<= 1)
+      {
+          /* void */
+      }
+
+    ctx->sh->inflight = ngx_slab_calloc (ctx->shpool,
+                                         n * sizeof (ngx_atomic_t));
+    if (ctx->sh->inflight == NULL)
+      {
+          ngx_log_error (NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                         "pta_zone \"%V\" is too small for %ui counters",
+                         &shm_zone->shm.name, ctx->counters);
+          return NGX_ERROR;
+      }
+
+    ctx->sh->inflight_mask = n - 1;
+
+    ctx->sh->rates = ngx_slab_calloc (ctx->shpool, n * sizeof (ngx_atomic_t));
+    ctx->sh->failures = ngx_slab_calloc (ctx->shpool,
+                                         n * sizeof (ngx_atomic_t));
+    if (ctx->sh->rates == NULL || ctx->sh->failures == NULL)
+      {
+          ngx_log_error (NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                         "pta_zone \"%V\" is too small for %ui counters",
+                         &shm_zone->shm.name, ctx->counters);
+          return NGX_ERROR;
+      }
+
+    len = sizeof (" in pta_zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc (ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL)
+      {
+          return NGX_ERROR;
+      }
+
+    ngx_sprintf (ctx->shpool->log_ctx, " in pta_zone \"%V\"%Z",
+                 &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+static char *
+ngx_http_pta_set_zone (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+{
+    ngx_http_pta_main_conf_t *pmcf = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_str_t name, s;
+    ssize_t size;
+    u_char *p;
+    ngx_int_t n;
+    ngx_uint_t i;
+    ngx_http_pta_zone_ctx_t *ctx;
+
+    if (pmcf->shm_zone != NULL)
+      {
+          return "is duplicate";
+      }
+
+    p = (u_char *) ngx_strchr (value[1].data, ':');
+    if (p == NULL || p == value[1].data)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid zone \"%V\", it must be name:size",
+                              &value[1]);
+          return NGX_CONF_ERROR;
+      }
+
+    name.data = value[1].data;
+    name.len = p - value[1].data;
+
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size (&s);
+    if (size == NGX_ERROR)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid zone size \"%V\"", &value[1]);
+          return NGX_CONF_ERROR;
+      }
+
+    if (size < (ssize_t) (8 * ngx_pagesize))
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "zone \"%V\" is too small", &value[1]);
+          return NGX_CONF_ERROR;
+      }
+
+    ctx = ngx_pcalloc (cf->pool, sizeof (ngx_http_pta_zone_ctx_t));
+    if (ctx == NULL)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    ctx->fingerprints = NGX_HTTP_PTA_ZONE_FINGERPRINTS;
+
+    ctx->counters = NGX_HTTP_PTA_ZONE_COUNTERS;
+
+    for (i = 2; i < cf->args->nelts; i++)
+      {
+          if (ngx_strncmp (value[i].data, "fingerprints=", 13) == 0)
+            {
+                n = ngx_atoi (value[i].data + 13, value[i].len - 13);
+                if (n == NGX_ERROR || n == 0)
+                  {
+                      goto invalid;
+                  }
+                ctx->fingerprints = n;
+                continue;
+            }
+
+          if (ngx_strncmp (value[i].data, "counters=", 9) == 0)
+            {
+                n = ngx_atoi (value[i].data + 9, value[i].len - 9);
+                if (n == NGX_ERROR || n < 2)
+                  {
+                      goto invalid;
+                  }
+                ctx->counters = n;
+                continue;
+            }
+
+          goto invalid;
+      }
+
+    pmcf->shm_zone = ngx_shared_memory_add (cf, &name, size,
+                                            &ngx_http_pta_module);
+    if (pmcf->shm_zone == NULL)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    if (pmcf->shm_zone->data)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "zone \"%V\" is already used", &name);
+          return NGX_CONF_ERROR;
+      }
+
+    pmcf->shm_zone->init = ngx_http_pta_init_zone;
+    pmcf->shm_zone->data = ctx;
+
+    return NGX_CONF_OK;
+
+  invalid:
+
+    ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                        "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+static char *
+ngx_http_pta_set_overload (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+{
+    ngx_http_pta_main_conf_t *pmcf = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_str_t s;
+    ngx_int_t n;
+    ngx_uint_t i;
+
+    if (pmcf->overload_on)
+      {
+          return "is duplicate";
+      }
+
+    n = ngx_atoi (value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid value \"%V\"", &value[1]);
+          return NGX_CONF_ERROR;
+      }
+
+    pmcf->overload_on = n;
+    pmcf->overload_off = (n + 1) / 2;
+    pmcf->overload_hold = 10;
+    pmcf->overload_max_token = 512;
+    pmcf->overload_max_candidates = 1;
+
+    for (i = 2; i < cf->args->nelts; i++)
+      {
+          if (ngx_strncmp (value[i].data, "off=", 4) == 0)
+            {
+                n = ngx_atoi (value[i].data + 4, value[i].len - 4);
+                if (n == NGX_ERROR || n == 0
+                    || (ngx_uint_t) n > pmcf->overload_on)
+                  {
+                      goto invalid;
+                  }
+                pmcf->overload_off = n;
+                continue;
+            }
+
+          if (ngx_strncmp (value[i].data, "hold=", 5) == 0)
+            {
+                s.len = value[i].len - 5;
+                s.data = value[i].data + 5;
+                pmcf->overload_hold = ngx_parse_time (&s, 1);
+                if (pmcf->overload_hold == (time_t) NGX_ERROR)
+                  {
+                      goto invalid;
+                  }
+                continue;
+            }
+
+          if (ngx_strncmp (value[i].data, "max_token=", 10) == 0)
+            {
+                n = ngx_atoi (value[i].data + 10, value[i].len - 10);
+                if (n == NGX_ERROR || n == 0)
+                  {
+                      goto invalid;
+                  }
+                pmcf->overload_max_token = n;
+                continue;
+            }
+
+          if (ngx_strncmp (value[i].data, "max_candidates=", 15) == 0)
+            {
+                n = ngx_atoi (value[i].data + 15, value[i].len - 15);
+                if (n == NGX_ERROR || n == 0 || n > NGX_HTTP_PTA_COOKIE_MAX)
+                  {
+                      goto invalid;
+                  }
+                pmcf->overload_max_candidates = n;
+                continue;
+            }
+
+          goto invalid;
+      }
+
+    return NGX_CONF_OK;
+
+  invalid:
+
+    ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                        "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+static char *
+ngx_http_pta_set_admin (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf (cf, ngx_http_core_module);
+    clcf->handler = ngx_http_pta_admin_handler;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_pta_set_status (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_http_pta_main_conf_t *pmcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf (cf, ngx_http_core_module);
+    clcf->handler = ngx_http_pta_status_handler;
+
+    pmcf = ngx_http_conf_get_module_main_conf (cf, ngx_http_pta_module);
+    pmcf->status = 1;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_pta_set_rate (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+{
+    ngx_http_pta_loc_conf_t *locc = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_int_t rate, scale, burst;
+    size_t len;
+
+    if (locc->rate != NGX_CONF_UNSET_UINT)
+      {
+          return "is duplicate";
+      }
+
+#if (NGX_PTR_SIZE < 8)
+    return "is not supported on this platform";
+#endif
+
+    len = value[1].len;
+    scale = 1;
+
+    if (len > 3 && ngx_strncmp (value[1].data + len - 3, "r/s", 3) == 0)
+      {
+          len -= 3;
+      }
+    else if (len > 3 && ngx_strncmp (value[1].data + len - 3, "r/m", 3) == 0)
+      {
+          len -= 3;
+          scale = 60;
+      }
 
-    if ((pta->decrypt_data.padding_val < 1)
-        || (16 < pta->decrypt_data.padding_val))
+    rate = ngx_atoi (value[1].data, len);
+    if (rate == NGX_ERROR || rate == 0)
       {
-          return 1;
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid rate \"%V\"", &value[1]);
+          return NGX_CONF_ERROR;
       }
 
-    ast = 0;
-    idx = 0;
-    wdx = 0;
-    while (pta->decrypt_data.url[wdx] != pta->decrypt_data.padding_val)
+    burst = 0;
+
+    if (cf->args->nelts == 3)
       {
-          if (pta->decrypt_data.url[wdx] == '\\'
-              && pta->decrypt_data.url[wdx + 1] == '*')
-            {
-                wdx++;
-                ast = 1;
-            }
-          if (ast == 0 && pta->decrypt_data.url[wdx] == '*')
+          if (ngx_strncmp (value[2].data, "burst=", 6) != 0)
             {
-                return ngx_http_pta_check_wildcard_url (r, pta, wdx, idx);
+                ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                                    "invalid parameter \"%V\"", &value[2]);
+                return NGX_CONF_ERROR;
             }
-          if (r->uri.data[idx] != pta->decrypt_data.url[wdx])
+
+          burst = ngx_atoi (value[2].data + 6, value[2].len - 6);
+          if (burst == NGX_ERROR || burst > NGX_HTTP_PTA_RATE_MAX_BURST)
             {
-                return 1;
+                ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                                    "invalid burst value \"%V\"", &value[2]);
+                return NGX_CONF_ERROR;
             }
-          idx++;
-          wdx++;
       }
 
-    if (idx != r->uri.len)
-      {
-          return 1;
-      }
+    locc->rate = rate * 1000 / scale;
+    locc->burst = burst * 1000;
 
-    return 0;
+    return NGX_CONF_OK;
 }
 
-static ngx_int_t
-ngx_http_pta_handler (ngx_http_request_t * r)
+static char *
+ngx_http_pta_set_fail_threshold (ngx_conf_t * cf, ngx_command_t * cmd,
+                                 void *conf)
 {
-    ngx_int_t ret;
-    ngx_http_pta_srv_conf_t *srv;
-    ngx_http_pta_loc_conf_t *loc;
-    ngx_http_pta_info_t pta;
-
-    if ((srv = ngx_http_get_module_srv_conf (r, ngx_http_pta_module)) == NULL)
-      {
-          return NGX_DECLINED;
-      }
+    ngx_http_pta_loc_conf_t *locc = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_str_t s;
+    ngx_int_t n;
+    ngx_uint_t i;
 
-    if ((loc = ngx_http_get_module_loc_conf (r, ngx_http_pta_module)) == NULL)
+    if (locc->fail_threshold != NGX_CONF_UNSET_UINT)
       {
-          return NGX_DECLINED;
+          return "is duplicate";
       }
 
-    if (!loc->pta_onoff)
-      {
-          return NGX_DECLINED;
-      }
+#if (NGX_PTR_SIZE < 8)
+    return "is not supported on this platform";
+#endif
 
-    if (r->internal)
+    n = ngx_atoi (value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0 || n > NGX_HTTP_PTA_FAIL_COUNT)
       {
-          return NGX_DECLINED;
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid value \"%V\"", &value[1]);
+          return NGX_CONF_ERROR;
       }
 
-    ngx_memzero (&pta, sizeof (pta));
-    ngx_http_pta_init_auth_type (r, loc, &pta);
+    locc->fail_threshold = n;
+    locc->fail_window = 10;
+    locc->fail_penalty = 60;
+    locc->fail_ipv4_prefix = 32;
+    locc->fail_ipv6_prefix = 64;
 
-  more:
-    ret = ngx_http_pta_decrypt (r, srv, &pta);
-    if (ret)
+    for (i = 2; i < cf->args->nelts; i++)
       {
-          return ret;
-      }
+          if (ngx_strncmp (value[i].data, "window=", 7) == 0)
+            {
+                s.len = value[i].len - 7;
+                s.data = value[i].data + 7;
+                locc->fail_window = ngx_parse_time (&s, 1);
+                if (locc->fail_window == (time_t) NGX_ERROR
+                    || locc->fail_window == 0)
+                  {
+                      goto invalid;
+                  }
+                continue;
+            }
 
-    ret = ngx_http_pta_check_deadline (&pta);
-    if (ret)
-      {
-          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0,
-                         "request is expired");
-          if (pta.auth_type == NGX_IIJPTA_AUTH_COOKIE)
+          if (ngx_strncmp (value[i].data, "penalty=", 8) == 0)
             {
-                pta.encrypt_data_array_idx++;
-                if (pta.encrypt_data_array_idx <
-                    pta.encrypt_data_array->nelts)
+                s.len = value[i].len - 8;
+                s.data = value[i].data + 8;
+                locc->fail_penalty = ngx_parse_time (&s, 1);
+                if (locc->fail_penalty == (time_t) NGX_ERROR
+                    || locc->fail_penalty == 0)
                   {
-                      ngx_log_error (NGX_LOG_INFO, r->connection->log, 0,
-                                     "checking next pta(index: %d)",
-                                     pta.encrypt_data_array_idx);
-                      goto more;
+                      goto invalid;
+                  }
+                continue;
+            }
 
+          if (ngx_strncmp (value[i].data, "ipv4=", 5) == 0)
+            {
+                n = ngx_atoi (value[i].data + 5, value[i].len - 5);
+                if (n == NGX_ERROR || n > 32)
+                  {
+                      goto invalid;
                   }
+                locc->fail_ipv4_prefix = n;
+                continue;
             }
-          return 410;
-      }
 
-    ret = ngx_http_pta_check_url (r, &pta);
-    if (ret)
-      {
-          ngx_log_error (NGX_LOG_ERR, r->connection->log, 0, "url is invalid");
-          if (pta.auth_type == NGX_IIJPTA_AUTH_COOKIE)
+          if (ngx_strncmp (value[i].data, "ipv6=", 5) == 0)
             {
-                pta.encrypt_data_array_idx++;
-                if (pta.encrypt_data_array_idx <
-                    pta.encrypt_data_array->nelts)
+                n = ngx_atoi (value[i].data + 5, value[i].len - 5);
+                if (n == NGX_ERROR || n > 128)
                   {
-                      ngx_log_error (NGX_LOG_INFO, r->connection->log, 0,
-                                     "checking next pta(index: %d)",
-                                     pta.encrypt_data_array_idx);
-                      goto more;
+                      goto invalid;
                   }
+                locc->fail_ipv6_prefix = n;
+                continue;
             }
-          return 403;
+
+          goto invalid;
       }
 
-    ngx_log_error (NGX_LOG_DEBUG, r->connection->log, 0, "successful");
+    return NGX_CONF_OK;
 
-    ngx_http_pta_delete_arg(r);
+  invalid:
 
-    return NGX_DECLINED;
+    ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                        "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
 }
 
-static void *
-ngx_http_pta_create_srv_conf (ngx_conf_t * cf)
+static char *
+ngx_http_pta_set_trusted (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
 {
-    ngx_http_pta_srv_conf_t *conf =
-        ngx_pcalloc (cf->pool, sizeof (ngx_http_pta_srv_conf_t));
-    if (conf == NULL)
+    ngx_http_pta_srv_conf_t *srvc = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_int_t rc;
+    ngx_uint_t i;
+    ngx_cidr_t cidr;
+
+    if (srvc->trusted == NULL)
       {
-          return NGX_CONF_ERROR;
-      }
+          srvc->trusted = ngx_radix_tree_create (cf->pool, -1);
+          if (srvc->trusted == NULL)
+            {
+                return NGX_CONF_ERROR;
+            }
 
-    return conf;
-}
+#if (NGX_HAVE_INET6)
+          srvc->trusted6 = ngx_radix_tree_create (cf->pool, -1);
+          if (srvc->trusted6 == NULL)
+            {
+                return NGX_CONF_ERROR;
+            }
+#endif
+      }
 
-static void *
-ngx_http_pta_create_loc_conf (ngx_conf_t * cf)
-{
-    ngx_http_pta_loc_conf_t *conf =
-        ngx_pcalloc (cf->pool, sizeof (ngx_http_pta_loc_conf_t));
-    if (conf == NULL)
+    for (i = 1; i < cf->args->nelts; i++)
       {
-          return NGX_CONF_ERROR;
-      }
+          rc = ngx_ptocidr (&value[i], &cidr);
+          if (rc == NGX_ERROR)
+            {
+                ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                                    "invalid network \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
 
-    conf->pta_onoff = NGX_CONF_UNSET;
+          if (rc == NGX_DONE)
+            {
+                ngx_conf_log_error (NGX_LOG_WARN, cf, 0,
+                                    "low address bits of %V are meaningless",
+                                    &value[i]);
+            }
 
-    return conf;
-}
+          switch (cidr.family)
+            {
+#if (NGX_HAVE_INET6)
+            case AF_INET6:
+                rc = ngx_radix128tree_insert (srvc->trusted6,
+                                              cidr.u.in6.addr.s6_addr,
+                                              cidr.u.in6.mask.s6_addr, 1);
+                break;
+#endif
 
-static char *
-ngx_http_pta_merge_loc_conf (ngx_conf_t * cf, void *parent, void *child)
-{
-    ngx_http_pta_loc_conf_t *prev = parent;
-    ngx_http_pta_loc_conf_t *conf = child;
+            default:
+                rc = ngx_radix32tree_insert (srvc->trusted,
+                                             ntohl (cidr.u.in.addr),
+                                             ntohl (cidr.u.in.mask), 1);
+                break;
+            }
 
-    ngx_conf_merge_value (conf->pta_onoff, prev->pta_onoff, 0);
-    ngx_conf_merge_uint_value (conf->pta_auth_method, prev->pta_auth_method,
-                               0);
+          // NGX_BUSY is a network given twice
+          if (rc == NGX_ERROR)
+            {
+                return NGX_CONF_ERROR;
+            }
+      }
 
     return NGX_CONF_OK;
 }
 
-static ngx_int_t
-ngx_http_pta_check_keyiv (ngx_conf_t * cf, ngx_str_t * arg)
+static char *
+ngx_http_pta_set_ticket_key (ngx_conf_t * cf, ngx_command_t * cmd,
+                             void *conf)
 {
-    size_t idx;
+    ngx_http_pta_srv_conf_t *srvc = conf;
+    ngx_str_t *value = cf->args->elts;
 
-    if (arg->len != 32)
+    if (ngx_http_pta_check_keyiv (cf, &value[1]))
       {
-          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0, "invalid length");
-          return 1;
+          return NGX_CONF_ERROR;
       }
 
-    for (idx = 0; idx < arg->len; idx++)
+    srvc->ticket_key.len = value[1].len / 2;
+    srvc->ticket_key.data = ngx_pnalloc (cf->pool, srvc->ticket_key.len);
+    if (srvc->ticket_key.data == NULL)
       {
-          if (!(arg->data[idx] == '0' ||
-                arg->data[idx] == '1' ||
-                arg->data[idx] == '2' ||
-                arg->data[idx] == '3' ||
-                arg->data[idx] == '4' ||
-                arg->data[idx] == '5' ||
-                arg->data[idx] == '6' ||
-                arg->data[idx] == '7' ||
-                arg->data[idx] == '8' ||
-                arg->data[idx] == '9' ||
-                arg->data[idx] == 'a' ||
-                arg->data[idx] == 'b' ||
-                arg->data[idx] == 'c' ||
-                arg->data[idx] == 'd' ||
-                arg->data[idx] == 'e' ||
-                arg->data[idx] == 'f' ||
-                arg->data[idx] == 'A' ||
-                arg->data[idx] == 'B' ||
-                arg->data[idx] == 'C' ||
-                arg->data[idx] == 'D' ||
-                arg->data[idx] == 'E' || arg->data[idx] == 'F'))
-            {
-                ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
-                                    "invalid character is found");
-                return 1;
-            }
+          return NGX_CONF_ERROR;
       }
 
-    return 0;
+    ngx_http_pta_hex2bin (value[1].data, value[1].len, srvc->ticket_key.data);
+
+    return NGX_CONF_OK;
 }
 
 static char *
-ngx_http_pta_set_1st_key (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+ngx_http_pta_set_session_ticket (ngx_conf_t * cf, ngx_command_t * cmd,
+                                 void *conf)
 {
-    ngx_http_pta_srv_conf_t *srvc = conf;
+    ngx_http_pta_loc_conf_t *locc = conf;
     ngx_str_t *value = cf->args->elts;
+    ngx_str_t s;
 
-    if (ngx_http_pta_check_keyiv (cf, &value[1]))
+    if (locc->session_ticket != NGX_CONF_UNSET)
+      {
+          return "is duplicate";
+      }
+
+    if (ngx_strcasecmp (value[1].data, (u_char *) "on") == 0)
       {
+          locc->session_ticket = 1;
+      }
+    else if (ngx_strcasecmp (value[1].data, (u_char *) "off") == 0)
+      {
+          locc->session_ticket = 0;
+      }
+    else
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid value \"%V\", it must be \"on\" or \"off\"",
+                              &value[1]);
           return NGX_CONF_ERROR;
       }
 
-    srvc->key_1st.len = value[1].len;
-    srvc->key_1st.data = ngx_pstrdup (cf->pool, &value[1]);
+    if (cf->args->nelts == 2)
+      {
+          return NGX_CONF_OK;
+      }
+
+    if (ngx_strncmp (value[2].data, "ttl=", 4) != 0)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid parameter \"%V\"", &value[2]);
+          return NGX_CONF_ERROR;
+      }
+
+    s.len = value[2].len - 4;
+    s.data = value[2].data + 4;
+
+    locc->session_ticket_ttl = ngx_parse_time (&s, 1);
+    if (locc->session_ticket_ttl == (time_t) NGX_ERROR
+        || locc->session_ticket_ttl == 0)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid ttl value \"%V\"", &value[2]);
+          return NGX_CONF_ERROR;
+      }
 
     return NGX_CONF_OK;
 }
 
 static char *
-ngx_http_pta_set_1st_iv (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+ngx_http_pta_set_assertion_key (ngx_conf_t * cf, ngx_command_t * cmd,
+                                void *conf)
 {
     ngx_http_pta_srv_conf_t *srvc = conf;
     ngx_str_t *value = cf->args->elts;
@@ -931,42 +7026,147 @@ ngx_http_pta_set_1st_iv (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
           return NGX_CONF_ERROR;
       }
 
-    srvc->iv_1st.len = value[1].len;
-    srvc->iv_1st.data = ngx_pstrdup (cf->pool, &value[1]);
+    srvc->assertion_key.len = value[1].len / 2;
+    srvc->assertion_key.data = ngx_pnalloc (cf->pool,
+                                            srvc->assertion_key.len);
+    if (srvc->assertion_key.data == NULL)
+      {
+          return NGX_CONF_ERROR;
+      }
+
+    ngx_http_pta_hex2bin (value[1].data, value[1].len,
+                          srvc->assertion_key.data);
 
     return NGX_CONF_OK;
 }
 
 static char *
-ngx_http_pta_set_2nd_key (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+ngx_http_pta_set_assertion (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
 {
-    ngx_http_pta_srv_conf_t *srvc = conf;
+    ngx_http_pta_loc_conf_t *locc = conf;
     ngx_str_t *value = cf->args->elts;
+    ngx_str_t s;
 
-    if (ngx_http_pta_check_keyiv (cf, &value[1]))
+    if (locc->assertion != NGX_CONF_UNSET)
+      {
+          return "is duplicate";
+      }
+
+    if (ngx_strcasecmp (value[1].data, (u_char *) "on") == 0)
+      {
+          locc->assertion = 1;
+      }
+    else if (ngx_strcasecmp (value[1].data, (u_char *) "off") == 0)
+      {
+          locc->assertion = 0;
+      }
+    else
       {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid value \"%V\", it must be \"on\" or \"off\"",
+                              &value[1]);
           return NGX_CONF_ERROR;
       }
 
-    srvc->key_2nd.len = value[1].len;
-    srvc->key_2nd.data = ngx_pstrdup (cf->pool, &value[1]);
+    if (cf->args->nelts == 2)
+      {
+          return NGX_CONF_OK;
+      }
+
+    if (ngx_strncmp (value[2].data, "ttl=", 4) != 0)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid parameter \"%V\"", &value[2]);
+          return NGX_CONF_ERROR;
+      }
+
+    s.len = value[2].len - 4;
+    s.data = value[2].data + 4;
+
+    locc->assertion_ttl = ngx_parse_time (&s, 1);
+    if (locc->assertion_ttl == (time_t) NGX_ERROR
+        || locc->assertion_ttl == 0)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid ttl value \"%V\"", &value[2]);
+          return NGX_CONF_ERROR;
+      }
 
     return NGX_CONF_OK;
 }
 
 static char *
-ngx_http_pta_set_2nd_iv (ngx_conf_t * cf, ngx_command_t * cmd, void *conf)
+ngx_http_pta_set_renew_within (ngx_conf_t * cf, ngx_command_t * cmd,
+                               void *conf)
 {
-    ngx_http_pta_srv_conf_t *srvc = conf;
+    ngx_http_pta_loc_conf_t *locc = conf;
     ngx_str_t *value = cf->args->elts;
+    ngx_str_t s;
+    ngx_uint_t i;
 
-    if (ngx_http_pta_check_keyiv (cf, &value[1]))
+    if (locc->renew_within != NGX_CONF_UNSET)
       {
+          return "is duplicate";
+      }
+
+    locc->renew_within = ngx_parse_time (&value[1], 1);
+    if (locc->renew_within == (time_t) NGX_ERROR)
+      {
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid value \"%V\"", &value[1]);
           return NGX_CONF_ERROR;
       }
 
-    srvc->iv_2nd.len = value[1].len;
-    srvc->iv_2nd.data = ngx_pstrdup (cf->pool, &value[1]);
+    for (i = 2; i < cf->args->nelts; i++)
+      {
+          if (ngx_strncmp (value[i].data, "lifetime=", 9) == 0)
+            {
+                s.len = value[i].len - 9;
+                s.data = value[i].data + 9;
+
+                locc->renew_lifetime = ngx_parse_time (&s, 1);
+                if (locc->renew_lifetime == (time_t) NGX_ERROR
+                    || locc->renew_lifetime == 0)
+                  {
+                      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                                          "invalid lifetime value \"%V\"",
+                                          &value[i]);
+                      return NGX_CONF_ERROR;
+                  }
+
+                continue;
+            }
+
+          if (ngx_strncmp (value[i].data, "max=", 4) == 0)
+            {
+                s.len = value[i].len - 4;
+                s.data = value[i].data + 4;
+
+                locc->renew_max = ngx_parse_time (&s, 1);
+                if (locc->renew_max == (time_t) NGX_ERROR
+                    || locc->renew_max == 0)
+                  {
+                      ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                                          "invalid max value \"%V\"",
+                                          &value[i]);
+                      return NGX_CONF_ERROR;
+                  }
+
+                continue;
+            }
+
+          if (ngx_strncmp (value[i].data, "header=", 7) == 0
+              && value[i].len > 7)
+            {
+                locc->renew_header.len = value[i].len - 7;
+                locc->renew_header.data = value[i].data + 7;
+                continue;
+            }
+
+          ngx_conf_log_error (NGX_LOG_EMERG, cf, 0,
+                              "invalid parameter \"%V\"", &value[i]);
+          return NGX_CONF_ERROR;
+      }
 
     return NGX_CONF_OK;
 }
@@ -0,0 +1,18 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls6/prog_index.m3u8?pta=f9844f30eb900f65be437da465eecfa9ff06c9aba0ccd784ff59c80ec29571f3');
+$rc = $ua->request($rq);
+is($rc->code, 200, "Cache-Control: 200");
+is($rc->header("Cache-Control"), "max-age=60", "Cache-Control: capped by max");
+ok(defined($rc->header("Expires")), "Cache-Control: Expires is set");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=3174ffad10cc165d58d154bdbd8a65de');
+$rc = $ua->request($rq);
+ok(!defined($rc->header("Cache-Control")), "Cache-Control: disabled by default");
+
+done_testing;
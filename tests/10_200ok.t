@@ -0,0 +1,33 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls7/prog_index.m3u8?pta=84fb7297fe7e5cca4ce6f81358e4294830072eecb9606087a29d25904ec93a77');
+$rc = $ua->request($rq);
+is($rc->code, 200, "Session ticket: query string 200");
+like($rc->header("Set-Cookie"), qr/^pta_st=[0-9]+:\/hls7\/\*:[-_0-9A-Za-z]{22}; Path=\/hls7\/; Max-Age=[0-9]+; HttpOnly$/, "Session ticket: issued");
+
+($ticket) = $rc->header("Set-Cookie") =~ /^(pta_st=[^;]+)/;
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls7/prog_index.m3u8');
+$rq->header("Cookie" => $ticket);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Session ticket: ticket 200");
+ok(!defined($rc->header("Set-Cookie")), "Session ticket: not issued again");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls7/prog_index.m3u8');
+$rq->header("Cookie" => $ticket . "x");
+$rc = $ua->request($rq);
+is($rc->code, 400, "Session ticket: broken ticket falls back");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls7/prog_index.m3u8');
+$rq->header("Cookie" => "pta_st=4102444800:/*:" . ("A" x 22));
+$rc = $ua->request($rq);
+is($rc->code, 400, "Session ticket: forged ticket falls back");
+
+done_testing;
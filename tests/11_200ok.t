@@ -0,0 +1,48 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+sub token {
+    my ($date, $url) = @_;
+    my @out = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date $date --url '$url' 2>/dev/null};
+    chomp(my $token = $out[-1]);
+    return $token;
+}
+
+$soon = token(time() + 60, '/hls8/*');
+$later = token(time() + 86400, '/hls8/*');
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => "http://localhost/hls8/prog_index.m3u8?pta=$soon");
+$rc = $ua->request($rq);
+is($rc->code, 200, "Renewal: query string 200");
+like($rc->header("Set-Cookie"), qr/^pta=[0-9a-f]{64}; Path=\/hls8\/; Max-Age=3600$/, "Renewal: renewed as cookie");
+
+($renewed) = $rc->header("Set-Cookie") =~ /^pta=([0-9a-f]+)/;
+$plain = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --cipher $renewed};
+like($plain, qr/^CRC : /m, "Renewal: valid CRC");
+like($plain, qr/^Path: \/hls8\/\*$/m, "Renewal: same path");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls8/prog_index.m3u8');
+$rq->header("Cookie" => "pta=$renewed");
+$rc = $ua->request($rq);
+is($rc->code, 200, "Renewal: renewed token 200");
+ok(!defined($rc->header("Set-Cookie")), "Renewal: not renewed again");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => "http://localhost/hls8/prog_index.m3u8?pta=$later");
+$rc = $ua->request($rq);
+is($rc->code, 200, "Renewal: query string 200");
+ok(!defined($rc->header("Set-Cookie")), "Renewal: not expiring soon");
+
+$soon = token(time() + 60, '/hls9/*');
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => "http://localhost/hls9/prog_index.m3u8?pta=$soon");
+$rc = $ua->request($rq);
+is($rc->code, 200, "Renewal: query string 200");
+like($rc->header("X-PTA-Token"), qr/^[0-9a-f]{64}$/, "Renewal: renewed as header");
+
+done_testing;
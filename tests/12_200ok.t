@@ -0,0 +1,32 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date 4102444800 --url '/hls10/*' 2>/dev/null | tail -1};
+chomp($token);
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls10/prog_index.m3u8');
+$rq->header("X-PTA-Token" => $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Header: token 200");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls10/prog_index.m3u8');
+$rq->header("Cookie" => "pta=" . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Header: fallback to cookie 200");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls10/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 400, "Header: query string is not accepted");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls10/prog_index.m3u8');
+$rq->header("X-PTA-Token" => "00" . $token);
+$rc = $ua->request($rq);
+is($rc->code, 403, "Header: broken token 403");
+
+done_testing;
@@ -0,0 +1,24 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date 4102444800 --url '/hls11/*' 2>/dev/null | tail -1};
+chomp($token);
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/pta/' . $token . '/hls11/prog_index.m3u8');
+$rc = $ua->request($rq);
+is($rc->code, 200, "Path: token 200");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/pta/' . $token . '/hls1/prog_index.m3u8');
+$rc = $ua->request($rq);
+is($rc->code, 403, "Path: other path 403");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/pta/hls11/prog_index.m3u8');
+$rc = $ua->request($rq);
+is($rc->code, 400, "Path: no token 400");
+
+done_testing;
@@ -0,0 +1,26 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date 4102444800 --url '/hls12/*' 2>/dev/null | tail -1};
+chomp($token);
+
+$ua = LWP::UserAgent->new();
+$rc = $ua->post('http://localhost/hls12/prog_index.m3u8', { a => "1", pta => $token, b => "x" x 65536 });
+is($rc->code, 200, "Body: token 200");
+
+$ua = LWP::UserAgent->new();
+$rc = $ua->post('http://localhost/hls12/prog_index.m3u8', { a => "1", b => "2" });
+is($rc->code, 400, "Body: no token 400");
+
+$ua = LWP::UserAgent->new();
+$rc = $ua->post('http://localhost/hls12/prog_index.m3u8', { pta => "00" . $token });
+is($rc->code, 403, "Body: broken token 403");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls12/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 400, "Body: GET 400");
+
+done_testing;
@@ -0,0 +1,27 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+sub token {
+    my ($url) = @_;
+    my $token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date 4102444800 --url '$url' 2>/dev/null | tail -1};
+    chomp($token);
+    return $token;
+}
+
+foreach $url ('/hls*/prog_*.m3u8', '/hls2/*_index.m3u?', '/*/*') {
+    $ua = LWP::UserAgent->new();
+    $rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . token($url));
+    $rc = $ua->request($rq);
+    is($rc->code, 200, "Wildcards: $url 200");
+}
+
+foreach $url ('/hls2/*/*.m3u8', '/hls2/prog_index.m3u8?', '/hls2/prog\*.m3u8') {
+    $ua = LWP::UserAgent->new();
+    $rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . token($url));
+    $rc = $ua->request($rq);
+    is($rc->code, 403, "Wildcards: $url 403");
+}
+
+done_testing;
@@ -0,0 +1,28 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+sub token {
+    my $urls = join(' ', map { "--url '$_'" } @_);
+    my $token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date 4102444800 $urls 2>/dev/null | tail -1};
+    chomp($token);
+    return $token;
+}
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . token('/hls9/*', '/hls2/prog_index.m3u8', '/keys/*'));
+$rc = $ua->request($rq);
+is($rc->code, 200, "Path set: exact path 200");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . token('/hls9/*', '/hls*/*.m3u8'));
+$rc = $ua->request($rq);
+is($rc->code, 200, "Path set: wildcard path 200");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . token('/hls9/*', '/hls3/*', '/hls2/prog_index.m3u'));
+$rc = $ua->request($rq);
+is($rc->code, 403, "Path set: no path matches 403");
+
+done_testing;
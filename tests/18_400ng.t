@@ -0,0 +1,31 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$date = 4102444800 - $$;
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date $date --url '/hls2/*' 2>/dev/null | tail -1};
+chomp($token);
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Revocation: not revoked yet 200");
+
+system("perl ../tools/ptarevoke.pl --out /tmp/pta_revoked $token 2>/dev/null");
+sleep(2);
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 403, "Revocation: revoked 403");
+
+system("perl ../tools/ptarevoke.pl --out /tmp/pta_revoked </dev/null 2>/dev/null");
+sleep(2);
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Revocation: unrevoked 200");
+
+done_testing;
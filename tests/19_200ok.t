@@ -0,0 +1,46 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date 4102444800 --url '/hls2/*' 2>/dev/null | tail -1};
+chomp($token);
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Prefix revocation: not revoked yet 200");
+
+$rq = HTTP::Request->new(POST => 'http://localhost/pta_admin');
+$rq->content("revoke-prefix /hls2/prog_\n");
+$rc = $ua->request($rq);
+is($rc->code, 200, "Prefix revocation: revoke-prefix 200");
+is($rc->content, "OK 1\n", "Prefix revocation: revoke-prefix applied");
+
+$rq = HTTP::Request->new(GET => 'http://localhost/pta_admin');
+$rc = $ua->request($rq);
+like($rc->content, qr{^/hls2/prog_$}m, "Prefix revocation: listed");
+
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 403, "Prefix revocation: revoked 403");
+
+$rq = HTTP::Request->new(POST => 'http://localhost/pta_admin');
+$rq->content("unrevoke-prefix /hls2/prog_\nbogus\n");
+$rc = $ua->request($rq);
+is($rc->code, 400, "Prefix revocation: invalid line 400");
+
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 403, "Prefix revocation: still revoked 403");
+
+$rq = HTTP::Request->new(POST => 'http://localhost/pta_admin');
+$rq->content("unrevoke-prefix /hls2/prog_\n");
+$rc = $ua->request($rq);
+is($rc->content, "OK 1\n", "Prefix revocation: unrevoke-prefix applied");
+
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Prefix revocation: unrevoked 200");
+
+done_testing;
@@ -0,0 +1,33 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$date = 4102444800 - $$;
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date $date --url '/hls2/*' 2>/dev/null | tail -1};
+chomp($token);
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Revocation delta: not revoked yet 200");
+
+$rq = HTTP::Request->new(POST => 'http://localhost/pta_admin');
+$rq->content(qx{perl ../tools/ptarevoke.pl --commands $token});
+$rc = $ua->request($rq);
+is($rc->content, "OK 1\n", "Revocation delta: revoke applied");
+
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 403, "Revocation delta: revoked 403");
+
+$rq = HTTP::Request->new(POST => 'http://localhost/pta_admin');
+$rq->content(qx{perl ../tools/ptarevoke.pl --commands --remove $token});
+$rc = $ua->request($rq);
+is($rc->content, "OK 1\n", "Revocation delta: unrevoke applied");
+
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Revocation delta: unrevoked 200");
+
+done_testing;
@@ -0,0 +1,31 @@
+use LWP::UserAgent;
+use IO::Socket::INET;
+use Test::More;
+
+use Data::Dumper;
+
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date 4102444800 --url '/hls13/*' 2>/dev/null | tail -1};
+chomp($token);
+
+# /hls13/ sends at 1k/s, so the first request stays in progress for
+# several seconds while only its header is read
+$sock = IO::Socket::INET->new(PeerAddr => 'localhost', PeerPort => 80, Proto => 'tcp');
+ok($sock, "Max concurrent: connected");
+print $sock "GET /hls13/prog_index.m3u8?pta=$token HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+$status = <$sock>;
+like($status, qr{^HTTP/1\.1 200}, "Max concurrent: first request 200");
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls13/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 503, "Max concurrent: concurrent request with the same token 503");
+
+# the count is given back when the first request ends
+1 while (<$sock>);
+close($sock);
+
+$rq = HTTP::Request->new(GET => 'http://localhost/hls13/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Max concurrent: request after the first one ended 200");
+
+done_testing;
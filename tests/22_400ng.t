@@ -0,0 +1,22 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$date = 4102444800 - $$;
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date $date --url '/hls14/*' 2>/dev/null | tail -1};
+chomp($token);
+
+for $i (1 .. 2) {
+    $ua = LWP::UserAgent->new();
+    $rq = HTTP::Request->new(GET => 'http://localhost/hls14/prog_index.m3u8?pta=' . $token);
+    $rc = $ua->request($rq);
+    is($rc->code, 200, "Rate: request $i within burst 200");
+}
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls14/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 503, "Rate: over the rate 503");
+
+done_testing;
@@ -0,0 +1,32 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date 4102444800 --url '/hls15/*' 2>/dev/null | tail -1};
+chomp($token);
+$bad = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date 4102444800 --url '/other/*' 2>/dev/null | tail -1};
+chomp($bad);
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls15/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Penalty box: valid token 200");
+
+for $i (1 .. 3) {
+    $rq = HTTP::Request->new(GET => 'http://localhost/hls15/prog_index.m3u8?pta=' . $bad);
+    $rc = $ua->request($rq);
+    is($rc->code, 403, "Penalty box: failure $i 403");
+}
+
+$rq = HTTP::Request->new(GET => 'http://localhost/hls15/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 403, "Penalty box: boxed client 403");
+
+sleep(4);
+
+$rq = HTTP::Request->new(GET => 'http://localhost/hls15/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Penalty box: penalty expired 200");
+
+done_testing;
@@ -0,0 +1,15 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost:8081/hls2/prog_index.m3u8?pta=00112233');
+$rc = $ua->request($rq);
+is($rc->code, 200, "Trusted: invalid token from a trusted network 200");
+
+$rq = HTTP::Request->new(GET => 'http://localhost:8081/hls2/prog_index.m3u8');
+$rc = $ua->request($rq);
+is($rc->code, 200, "Trusted: no token from a trusted network 200");
+
+done_testing;
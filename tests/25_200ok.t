@@ -0,0 +1,24 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date 4102444800 --url '/hls16/*' 2>/dev/null | tail -1};
+chomp($token);
+
+# the inner tier on 8082 passes on the assertion the edge has added
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls16/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Assertion: edge to inner tier 200");
+
+$rq = HTTP::Request->new(GET => 'http://localhost:8082/hls16/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 403, "Assertion: inner tier without an assertion 403");
+
+$rq = HTTP::Request->new(GET => 'http://localhost:8082/hls16/prog_index.m3u8');
+$rq->header('X-PTA-Assertion' => '4102444800:4102444800:AAAAAAAAAAAAAAAAAAAAAA');
+$rc = $ua->request($rq);
+is($rc->code, 400, "Assertion: forged assertion 400");
+
+done_testing;
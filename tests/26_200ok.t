@@ -0,0 +1,39 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+# /hls17/ sends prog_index.m3u8 of 7019 bytes at 1k/s, in about 7 seconds
+$size = 7019;
+
+# a response that ends before the deadline isn't cut
+$date = time() + 60;
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date $date --url '/hls17/*' 2>/dev/null | tail -1};
+chomp($token);
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls17/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Deadline during response: response before the deadline 200");
+is(length($rc->content), $size, "Deadline during response: response before the deadline is complete");
+
+# a response started just before the deadline is cut off when it comes
+$date = time() + 3;
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date $date --url '/hls17/*' 2>/dev/null | tail -1};
+chomp($token);
+
+$start = time();
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls17/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Deadline during response: response started before the deadline 200");
+ok(defined($rc->header("X-Died")) || length($rc->content) < $size, "Deadline during response: response is truncated");
+ok(time() - $start < 7, "Deadline during response: connection is closed at the deadline");
+
+sleep(2);
+
+$rq = HTTP::Request->new(GET => 'http://localhost/hls17/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 410, "Deadline during response: request after the deadline 410");
+
+done_testing;
@@ -0,0 +1,29 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date 4102444800 --url '/hls2/*' 2>/dev/null | tail -1};
+chomp($token);
+
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Status: verified 200");
+
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=0011');
+$rc = $ua->request($rq);
+is($rc->code, 403, "Status: not decrypted 403");
+
+$rq = HTTP::Request->new(GET => 'http://localhost/pta_status');
+$rc = $ua->request($rq);
+is($rc->code, 200, "Status: pta_status 200");
+like($rc->content, qr{^pta_verifications_total\{location="/hls2/",outcome="pass"\} [1-9]}m, "Status: pass counted");
+like($rc->content, qr{^pta_failures_total\{location="/hls2/",reason="decrypt"\} [1-9]}m, "Status: decrypt failure counted");
+like($rc->content, qr{^pta_methods_total\{location="/hls2/",method="qs"\} [1-9]}m, "Status: qs counted");
+
+$rq = HTTP::Request->new(POST => 'http://localhost/pta_status');
+$rc = $ua->request($rq);
+is($rc->code, 405, "Status: POST 405");
+
+done_testing;
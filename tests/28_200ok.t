@@ -0,0 +1,21 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+$token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date 4102444800 --url '/hls2/*' 2>/dev/null | tail -1};
+chomp($token);
+
+# every verification is timed with pta_timing_sample 1
+$ua = LWP::UserAgent->new();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=' . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Timing: verified 200");
+
+$rq = HTTP::Request->new(GET => 'http://localhost/pta_status');
+$rc = $ua->request($rq);
+is($rc->code, 200, "Timing: pta_status 200");
+like($rc->content, qr{^pta_stage_seconds_count\{stage="decrypt"\} [1-9]}m, "Timing: decrypt timed");
+like($rc->content, qr{^pta_stage_seconds_bucket\{stage="decrypt",le="\+Inf"\} [1-9]}m, "Timing: decrypt histogram");
+
+done_testing;
@@ -0,0 +1,69 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+sub ptapp {
+    my ($key, $iv, $url) = @_;
+    my $token = qx{perl ../tools/ptapp.pl --key $key --iv $iv --date 4102444800 --url '$url' 2>/dev/null | tail -1};
+    chomp($token);
+    return $token;
+}
+
+sub overload_active {
+    my $rc = $ua->request(HTTP::Request->new(GET => 'http://localhost/pta_status'));
+    return ($rc->content =~ m{^pta_overload_active (\d+)}m) ? $1 : -1;
+}
+
+# longer than max_token, 512 hex digits
+$long = ptapp('0102030405060708090a0b0c0d0e0f00', '00000000000000000000000000000000', '/hls4/' . ('*' x 300));
+$second = ptapp('11111111111111111111111111111111', '22222222222222222222222222222222', '/hls4/*');
+$token = ptapp('0102030405060708090a0b0c0d0e0f00', '00000000000000000000000000000000', '/hls4/*');
+
+$ua = LWP::UserAgent->new(keep_alive => 1);
+
+is(overload_active(), 0, "Overload: off at first");
+
+$rc = $ua->request(HTTP::Request->new(GET => 'http://localhost/hls4/prog_index.m3u8?pta=' . $long));
+is($rc->code, 200, "Overload: long token 200 before");
+
+$rc = $ua->request(HTTP::Request->new(GET => 'http://localhost/hls4/prog_index.m3u8?pta=' . $second));
+is($rc->code, 200, "Overload: 2nd key 200 before");
+
+$rq = HTTP::Request->new(GET => 'http://localhost/hls4/prog_index.m3u8');
+$rq->header("Cookie" => "pta=" . $token);
+$rc = $ua->request($rq);
+is($rc->code, 200, "Overload: cookie fallback 200 before");
+
+# more failures than pta_overload per second, until the mode is on
+$until = time + 10;
+while (time < $until && overload_active() != 1) {
+    for $i (1 .. 100) {
+        $ua->request(HTTP::Request->new(GET => 'http://localhost/hls2/prog_index.m3u8?pta=0011'));
+    }
+}
+is(overload_active(), 1, "Overload: on after failures");
+
+$rc = $ua->request(HTTP::Request->new(GET => 'http://localhost/hls4/prog_index.m3u8?pta=' . $long));
+is($rc->code, 400, "Overload: long token 400");
+
+$rc = $ua->request(HTTP::Request->new(GET => 'http://localhost/hls4/prog_index.m3u8?pta=' . $second));
+is($rc->code, 403, "Overload: 2nd key 403");
+
+$rq = HTTP::Request->new(GET => 'http://localhost/hls4/prog_index.m3u8');
+$rq->header("Cookie" => "pta=" . $token);
+$rc = $ua->request($rq);
+isnt($rc->code, 200, "Overload: no cookie fallback");
+
+$rc = $ua->request(HTTP::Request->new(GET => 'http://localhost/hls4/prog_index.m3u8?pta=' . $token));
+is($rc->code, 200, "Overload: 1st key 200");
+
+# calm down for the tests after this one
+$until = time + 20;
+while (time < $until && overload_active() != 0) {
+    $ua->request(HTTP::Request->new(GET => 'http://localhost/hls4/prog_index.m3u8?pta=' . $token));
+    sleep(1);
+}
+is(overload_active(), 0, "Overload: off after calm");
+
+done_testing;
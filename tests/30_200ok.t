@@ -0,0 +1,47 @@
+use LWP::UserAgent;
+use Test::More;
+
+use Data::Dumper;
+
+sub ptapp {
+    my ($date, $url) = @_;
+    my $token = qx{perl ../tools/ptapp.pl --key 0102030405060708090a0b0c0d0e0f00 --iv 00000000000000000000000000000000 --date $date --url '$url' 2>/dev/null | tail -1};
+    chomp($token);
+    return $token;
+}
+
+sub candidates {
+    my $rc = $ua->request(HTTP::Request->new(GET => 'http://localhost/pta_status'));
+    return ($rc->content =~ m{^pta_cookie_candidates_total\{location="/hls3/"\} (\d+)}m) ? $1 : 0;
+}
+
+$expired = ptapp(time - 60, '/hls3/*');
+$other = ptapp(4102444800, '/foo/*');
+$valid = ptapp(4102444800, '/hls3/*');
+
+$ua = LWP::UserAgent->new();
+
+$n = candidates();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls3/prog_index.m3u8');
+$rq->header("Cookie" => "pta=$expired; pta=$other; pta=$valid");
+$rc = $ua->request($rq);
+is($rc->code, 200, "Cookies: valid last 200");
+is(candidates() - $n, 1, "Cookies: valid one tried first");
+
+# the valid one is found in the cache of accepted cookies this time
+$n = candidates();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls3/prog_index.m3u8');
+$rq->header("Cookie" => "pta=$other; pta=$expired; pta=$valid");
+$rc = $ua->request($rq);
+is($rc->code, 200, "Cookies: seen cookie 200");
+is(candidates() - $n, 1, "Cookies: seen cookie tried first");
+
+# the expired one with the right path is tried first, the other last
+$n = candidates();
+$rq = HTTP::Request->new(GET => 'http://localhost/hls3/prog_index.m3u8');
+$rq->header("Cookie" => "pta=$other; pta=$expired");
+$rc = $ua->request($rq);
+is($rc->code, 403, "Cookies: none valid 403");
+is(candidates() - $n, 2, "Cookies: all tried");
+
+done_testing;
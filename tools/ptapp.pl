@@ -15,23 +15,27 @@ sub usage {
     my $prog = (split('/', $0))[-1];
     print STDERR <<"__HDOC__";
 Usage:
-    $prog --key 32HEXCHARACTERS --iv 32HEXCHARACTERS --date UNIXTIME --url URL
+    $prog --key 32HEXCHARACTERS --iv 32HEXCHARACTERS --date UNIXTIME --url URL [--url URL ...]
     $prog --key 32HEXCHARACTERS --iv 32HEXCHARACTERS --cipher ENCRYPTEDSTRING
 __HDOC__
     exit 1;
 }
 
 my ($key, $iv, $unixtime, $url, $cipher, $crc);
+my @urls;
 
 GetOptions("key=s"    => \$key,
            "iv=s"     => \$iv,
            "date=s"   => \$unixtime,
-           "url=s"    => \$url,
+           "url=s"    => \@urls,
            "cipher=s" => \$cipher,
 #          "crc=i"    => \$crc,
            "h|help"   => sub { usage(); exit 1; },
 ) or die "Error in command line arguments\n";
 
+# several paths make a path set, separated by NUL
+$url = join("\0", @urls) if (@urls);
+
 unless (defined($key) && defined($iv) && defined($unixtime) && defined($url)
         or
         defined($key) && defined($iv) && defined($cipher)) {
@@ -61,7 +65,7 @@ if (defined($cipher)) {
 	printf "CRC : 0x%s(%d)\n", $bseq[0], hex($bseq[0]);
     }
     printf "Date: %s\n", scalar(localtime(hex($bseq[1])));
-    printf "Path: %s\n", join('', map {chr(hex($_))} @bseq[2..($#bseq - hex($bseq[-1]))]);
+    printf "Path: %s\n", $_ foreach (split(/\0/, join('', map {chr(hex($_))} @bseq[2..($#bseq - hex($bseq[-1]))])));
     #say sprintf "<< CRC check failed >>\nValid CRC: 0x%08x (%d)", $byte[0], $byte[0];
 } else {
     $date = localtime($unixtime);
@@ -69,7 +73,7 @@ if (defined($cipher)) {
     $date = pack("C*", (0, 0, 0, 0, (map {hex($_)}
                                      unpack("(A2)*", sprintf("%08x",$unixtime)))));
     $url = pack("C*", (map {ord($_)} unpack("(A1)*", $url)));
-    warn " URL: $url\n";
+    warn " URL: $_\n" foreach (split(/\0/, $url));
     my $plain = $date . $url;
     $crc = Crypt::CRC32::crc32($plain);
     warn sprintf(" CRC: 0x%08x (%d)\n", $crc, $crc);
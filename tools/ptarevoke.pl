@@ -0,0 +1,91 @@
+#!/usr/bin/env perl
+package main;
+
+use strict;
+use warnings;
+use v5.10;
+use Getopt::Long;
+
+sub usage {
+    my $prog = (split('/', $0))[-1];
+    print STDERR <<"__HDOC__";
+Usage:
+    $prog --out FILE [--merge FILE] [TOKEN ...]
+    $prog --list FILE
+    $prog --commands [--remove] [TOKEN ...]
+__HDOC__
+    exit 1;
+}
+
+my ($out, $merge, $list, $commands, $remove);
+
+GetOptions("out=s"    => \$out,
+           "merge=s"  => \$merge,
+           "list=s"   => \$list,
+           "commands" => \$commands,
+           "remove"   => \$remove,
+           "h|help"  => sub { usage(); exit 1; },
+) or die "Error in command line arguments\n";
+
+# the format is "PTAR", version 1 and the number of fingerprints, each
+# 32-bit big endian, then the sorted fingerprints of 8 bytes, which are
+# the last 8 bytes of the cipher text of each token
+sub read_file {
+    my $file = shift;
+    my %fp;
+
+    open(my $fh, '<:raw', $file) or die "$file: $!\n";
+    local $/;
+    my $data = <$fh>;
+    close($fh);
+
+    my ($magic, $version, $count) = unpack("a4NN", $data);
+    die "$file: not a revocation file\n"
+        unless (defined($count) && $magic eq "PTAR" && $version == 1);
+    die "$file: truncated\n" if (length($data) < 12 + $count * 8);
+
+    $fp{unpack("H16", substr($data, 12 + $_ * 8, 8))} = 1 for (0 .. $count - 1);
+    return %fp;
+}
+
+if (defined($list)) {
+    my %fp = read_file($list);
+    print "$_\n" foreach (sort keys %fp);
+    exit 0;
+}
+
+usage() unless (defined($out) || defined($commands));
+
+my %fp = defined($merge) ? read_file($merge) : ();
+my @tokens = @ARGV;
+unless (@tokens) {
+    chomp(@tokens = <STDIN>);
+}
+
+foreach my $token (@tokens) {
+    next if ($token =~ /^\s*$/);
+    $token = lc($token);
+    die "invalid token: $token\n"
+        unless ($token =~ /^([0-9a-f]{2})+$/ && length($token) >= 64);
+    $fp{substr($token, -16)} = 1;
+}
+
+my @sorted = sort keys %fp;
+
+# lines for the body of a POST to pta_admin
+if (defined($commands)) {
+    my $op = $remove ? "unrevoke" : "revoke";
+    print "$op $_\n" foreach (@sorted);
+    exit 0;
+}
+
+open(my $fh, '>:raw', "$out.tmp") or die "$out.tmp: $!\n";
+print $fh pack("a4NN", "PTAR", 1, scalar(@sorted));
+print $fh pack("H16", $_) foreach (@sorted);
+close($fh) or die "$out.tmp: $!\n";
+
+# nginx maps the file, so it's replaced rather than rewritten in place
+rename("$out.tmp", $out) or die "$out: $!\n";
+warn sprintf(" %d fingerprints\n", scalar(@sorted));
+
+exit;